@@ -0,0 +1,199 @@
+/* pg_timeout--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_timeout" to load this file. \quit
+
+CREATE FUNCTION pg_timeout_launch()
+RETURNS pg_catalog.int4 STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION pg_timeout_stop()
+RETURNS pg_catalog.bool STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_timeout_launch() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_timeout_stop() FROM PUBLIC;
+
+-- argument of pg_timeout.policy_function
+CREATE TYPE pg_timeout_candidate AS (
+	pid			pg_catalog.int4,
+	role		pg_catalog.name,
+	db			pg_catalog.name,
+	app			pg_catalog.text,
+	client_addr	pg_catalog.inet,
+	idle_for	pg_catalog.interval,
+	xact_age	pg_catalog.interval
+);
+
+CREATE FUNCTION pg_timeout_policy(
+	OUT generation pg_catalog.int8,
+	OUT published pg_catalog.timestamptz,
+	OUT naptime pg_catalog.float8,
+	OUT idle_session_timeout pg_catalog.float8,
+	OUT policy_function pg_catalog.text)
+RETURNS record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION pg_timeout_status(
+	OUT worker_pid pg_catalog.int4,
+	OUT worker_start pg_catalog.timestamptz,
+	OUT last_check pg_catalog.timestamptz,
+	OUT terminated pg_catalog.int8,
+	OUT errors pg_catalog.int8,
+	OUT consecutive_errors pg_catalog.int4,
+	OUT last_error_time pg_catalog.timestamptz,
+	OUT last_error pg_catalog.text,
+	OUT check_interval pg_catalog.float8,
+	OUT check_cpu_time pg_catalog.float8,
+	OUT cpu_percent pg_catalog.float8)
+RETURNS record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_timeout_status() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_timeout_status() TO pg_read_all_stats;
+
+CREATE FUNCTION pg_timeout_reclaim_stats(
+	OUT reclaimed pg_catalog.int8,
+	OUT stuck pg_catalog.int8,
+	OUT pending pg_catalog.int4,
+	OUT latency_p50 pg_catalog.float8,
+	OUT latency_p90 pg_catalog.float8,
+	OUT latency_p99 pg_catalog.float8,
+	OUT latency_max pg_catalog.float8)
+RETURNS record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION pg_timeout_activity_history(
+	OUT sample_time pg_catalog.timestamptz,
+	OUT pid pg_catalog.int4,
+	OUT usesysid pg_catalog.oid,
+	OUT datid pg_catalog.oid,
+	OUT state pg_catalog.text,
+	OUT wait_event_type pg_catalog.text,
+	OUT wait_event pg_catalog.text,
+	OUT query_id pg_catalog.int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_timeout_activity_history AS
+	SELECT h.sample_time, h.pid, h.datid, d.datname, h.usesysid,
+		   r.rolname AS usename, h.state, h.wait_event_type, h.wait_event,
+		   h.query_id
+	FROM pg_timeout_activity_history() h
+	LEFT JOIN pg_catalog.pg_database d ON d.oid = h.datid
+	LEFT JOIN pg_catalog.pg_roles r ON r.oid = h.usesysid;
+
+REVOKE ALL ON FUNCTION pg_timeout_activity_history() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_timeout_activity_history() TO pg_read_all_stats;
+GRANT SELECT ON pg_timeout_activity_history TO pg_read_all_stats;
+
+CREATE FUNCTION pg_timeout_state_times(
+	OUT usesysid pg_catalog.oid,
+	OUT datid pg_catalog.oid,
+	OUT application_name pg_catalog.text,
+	OUT sessions pg_catalog.int8,
+	OUT active_time pg_catalog.float8,
+	OUT idle_time pg_catalog.float8,
+	OUT idle_in_transaction_time pg_catalog.float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_timeout_state_times AS
+	SELECT t.datid, d.datname, t.usesysid, r.rolname AS usename,
+		   t.application_name, t.sessions, t.active_time, t.idle_time,
+		   t.idle_in_transaction_time
+	FROM pg_timeout_state_times() t
+	LEFT JOIN pg_catalog.pg_database d ON d.oid = t.datid
+	LEFT JOIN pg_catalog.pg_roles r ON r.oid = t.usesysid;
+
+REVOKE ALL ON FUNCTION pg_timeout_state_times() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_timeout_state_times() TO pg_read_all_stats;
+GRANT SELECT ON pg_timeout_state_times TO pg_read_all_stats;
+
+CREATE FUNCTION pg_timeout_pool_advice(
+	OUT usesysid pg_catalog.oid,
+	OUT datid pg_catalog.oid,
+	OUT application_name pg_catalog.text,
+	OUT peak_active pg_catalog.int4,
+	OUT p99_active pg_catalog.int4,
+	OUT idle_gap_p50 pg_catalog.float8,
+	OUT idle_gap_p90 pg_catalog.float8,
+	OUT idle_gap_p99 pg_catalog.float8,
+	OUT pool_size pg_catalog.int4,
+	OUT idle_timeout pg_catalog.float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_timeout_pool_advice() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_timeout_pool_advice() TO pg_read_all_stats;
+
+CREATE FUNCTION pg_timeout_drain(
+	IN db pg_catalog.name,
+	IN deadline pg_catalog.timestamptz,
+	OUT pid pg_catalog.int4,
+	OUT usename pg_catalog.text,
+	OUT application_name pg_catalog.text,
+	OUT state pg_catalog.text,
+	OUT state_change pg_catalog.timestamptz,
+	OUT query pg_catalog.text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_timeout_drain(pg_catalog.name, pg_catalog.timestamptz) FROM PUBLIC;
+
+CREATE FUNCTION pg_timeout_shadow_stats(
+	OUT both_terminate pg_catalog.int8,
+	OUT shadow_only pg_catalog.int8,
+	OUT live_only pg_catalog.int8)
+RETURNS record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION pg_timeout_shadow_report(
+	OUT event_time pg_catalog.timestamptz,
+	OUT pid pg_catalog.int4,
+	OUT usesysid pg_catalog.oid,
+	OUT datid pg_catalog.oid,
+	OUT application_name pg_catalog.text,
+	OUT idle_for pg_catalog.float8,
+	OUT live_timeout pg_catalog.float8,
+	OUT shadow_timeout pg_catalog.float8,
+	OUT decision pg_catalog.text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_timeout_shadow_report AS
+	SELECT s.event_time, s.pid, s.datid, d.datname, s.usesysid,
+		   r.rolname AS usename, s.application_name, s.idle_for,
+		   s.live_timeout, s.shadow_timeout, s.decision
+	FROM pg_timeout_shadow_report() s
+	LEFT JOIN pg_catalog.pg_database d ON d.oid = s.datid
+	LEFT JOIN pg_catalog.pg_roles r ON r.oid = s.usesysid;
+
+REVOKE ALL ON FUNCTION pg_timeout_shadow_report() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_timeout_shadow_report() TO pg_read_all_stats;
+GRANT SELECT ON pg_timeout_shadow_report TO pg_read_all_stats;
+
+CREATE FUNCTION pg_timeout_host_status(
+	OUT postmaster_pid pg_catalog.int4,
+	OUT data_directory pg_catalog.text,
+	OUT updated pg_catalog.timestamptz,
+	OUT idle_sessions pg_catalog.int4,
+	OUT idle_memory pg_catalog.int8,
+	OUT evicting pg_catalog.int8,
+	OUT is_local pg_catalog.bool)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_timeout_host_status() FROM PUBLIC;
@@ -11,6 +11,15 @@
  */
 #include "postgres.h"
 
+#include <ctype.h>
+#include <math.h>
+#ifndef WIN32
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+#include <sys/resource.h>
+#include <sys/stat.h>
+
 /* These are always necessary for a bgworker */
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
@@ -18,23 +27,84 @@
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
+#include "access/htup_details.h"
+#include "access/transam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#if PG_VERSION_NUM >= 150000
+#include "access/xlogrecovery.h"
+#endif
+#include "catalog/pg_type.h"
+#include "commands/async.h"
+#include "commands/dbcommands.h"
+#include "common/file_utils.h"
+#include "common/ip.h"
+#include "common/relpath.h"
 #include "executor/spi.h"
 #include "fmgr.h"
+#include "funcapi.h"
 #include "lib/stringinfo.h"
+#include "libpq/ifaddr.h"
 #include "pgstat.h"
+#include "pgtime.h"
+#include "replication/walreceiver.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/backend_status.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
 #include "tcop/utility.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/dsm_registry.h"
+#endif
+
+#if PG_VERSION_NUM < 140000
+#error "pg_timeout requires PostgreSQL 14 or later"
+#endif
+
+#include "pg_timeout.h"
+
+#if PG_VERSION_NUM >= 160000
+#define pg_timeout_fetch_beentry(i) pgstat_get_local_beentry_by_index(i)
+#else
+#define pg_timeout_fetch_beentry(i) pgstat_fetch_stat_local_beentry(i)
+#endif
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(pg_timeout_main);
+PG_FUNCTION_INFO_V1(pg_timeout_launch);
+PG_FUNCTION_INFO_V1(pg_timeout_stop);
+PG_FUNCTION_INFO_V1(pg_timeout_policy);
+PG_FUNCTION_INFO_V1(pg_timeout_status);
+PG_FUNCTION_INFO_V1(pg_timeout_reclaim_stats);
+PG_FUNCTION_INFO_V1(pg_timeout_activity_history);
+PG_FUNCTION_INFO_V1(pg_timeout_state_times);
+PG_FUNCTION_INFO_V1(pg_timeout_pool_advice);
+PG_FUNCTION_INFO_V1(pg_timeout_drain);
+PG_FUNCTION_INFO_V1(pg_timeout_shadow_report);
+PG_FUNCTION_INFO_V1(pg_timeout_shadow_stats);
+PG_FUNCTION_INFO_V1(pg_timeout_host_status);
 
 void		_PG_init(void);
+PGDLLEXPORT void pg_timeout_worker_main(Datum main_arg);
+
+/* hooks for other extensions, see pg_timeout.h */
+pg_timeout_candidate_hook_type pg_timeout_candidate_hook = NULL;
+pg_timeout_terminated_hook_type pg_timeout_terminated_hook = NULL;
 
 /* 
  * flags set by signal handlers 
@@ -44,14 +114,570 @@ static volatile sig_atomic_t got_sigterm = false;
 
 /* GUC variables */
 
+/* values of pg_timeout.pressure_selection */
+typedef enum
+{
+	PRESSURE_SELECTION_SCORE,
+	PRESSURE_SELECTION_FAIR_SHARE
+} PressureSelection;
+
+static const struct config_enum_entry pressure_selection_options[] = {
+	{"score", PRESSURE_SELECTION_SCORE, false},
+	{"fair_share", PRESSURE_SELECTION_FAIR_SHARE, false},
+	{NULL, 0, false}
+};
+
 /*
- * parameter default value in seconds set by _PG_init 
+ * parameter default value set by _PG_init, durations are in seconds with
+ * millisecond precision
  */
-static int	pg_timeout_idle_session_timeout = 0;
-static int	pg_timeout_naptime = 0;
+static double pg_timeout_idle_session_timeout = 0;
+static double pg_timeout_naptime = 0;
+static double pg_timeout_min_naptime = 0;
+static double pg_timeout_max_cpu_percent = 0;
+static char *pg_timeout_policy_function = NULL;
+static int	pg_timeout_pressure_threshold = 0;
+static double pg_timeout_pressure_min_idle = 0;
+static double pg_timeout_score_idle_weight = 1.0;
+static double pg_timeout_score_memory_weight = 1.0;
+static double pg_timeout_score_age_weight = 1.0;
+static double pg_timeout_score_reconnect_weight = 1.0;
+static double pg_timeout_warning_time = 0;
+static char *pg_timeout_schedule = NULL;
+static char *pg_timeout_schedule_timezone = NULL;
+static int	pg_timeout_max_idle_per_role = 0;
+static int	pg_timeout_max_idle_per_database = 0;
+static double pg_timeout_sample_interval = 0;
+static int	pg_timeout_history_size = 10000;	/* fixed without preloading */
+static int	pg_timeout_max_accounts = 1000;	/* fixed without preloading */
+static char *pg_timeout_exemptions = NULL;
+static double pg_timeout_exempt_idle_session_timeout = 0;
+static double pg_timeout_terminate_timeout = 0;
+static int	pg_timeout_pressure_selection = PRESSURE_SELECTION_SCORE;
+static char *pg_timeout_tenant_priorities = NULL;
+static double pg_timeout_standby_lag_threshold = 0;
+static int	pg_timeout_temp_files_threshold = 0;
+static char *pg_timeout_host_segment = NULL;
+static int	pg_timeout_host_memory_threshold = 0;
+static char *pg_timeout_policies = NULL;
+static char *pg_timeout_shadow_policies = NULL;
+
+/* PG_TIMEOUT_EXEMPT_* flags of pg_timeout.exemptions */
+static int	pg_timeout_exemption_flags = 0;
+
+/* checks failed in a row, the worker retries sooner than naptime */
+static int	worker_consecutive_errors = 0;
+
+/* CPU time of a check in milliseconds, smoothed, -1 until measured */
+static double worker_check_cpu_ms = -1;
+
+/* weight of the last check in worker_check_cpu_ms */
+#define CHECK_CPU_SMOOTHING	0.3
+
+/* seconds before the postmaster restarts a worker which has crashed */
+#define WORKER_RESTART_TIME	1
+
+/* delay before the first retry after an error, doubled on each failure */
+#define RETRY_MIN_DELAY_MS	100
+
+/* statement calling pg_timeout.policy_function, kept across checks */
+static SPIPlanPtr policy_plan = NULL;
+static char *policy_plan_function = NULL;
 
 #define LOG_MESSAGE "%s: idle session PID=%d user=%s database=%s application=%s hostname=%s"
 static char 	*null_value="NULL";
+
+#define MAX_SCHEDULES		32
+#define MINUTES_PER_DAY		1440
+#define MINUTES_PER_WEEK	(7 * MINUTES_PER_DAY)
+
+/*
+ * One entry of pg_timeout.schedule: idle session timeout applying during a
+ * time window on some days of the week, optionally to a single role.
+ */
+typedef struct PgTimeoutSchedule
+{
+	uint8		days;			/* bit 0 is Sunday */
+	int			start;			/* minutes since midnight */
+	int			length;			/* in minutes, may span midnight */
+	char		role[NAMEDATALEN];	/* empty for all roles */
+	Oid			roleid;			/* resolved when the policy is compiled */
+	int64		timeout_ms;
+} PgTimeoutSchedule;
+
+/* pg_timeout.schedule once parsed by its check hook */
+typedef struct PgTimeoutSchedules
+{
+	int			nschedules;
+	PgTimeoutSchedule schedules[MAX_SCHEDULES];
+} PgTimeoutSchedules;
+
+static PgTimeoutSchedules *pg_timeout_schedules = NULL;
+
+#define MAX_TENANT_PRIORITIES	32
+
+/*
+ * One entry of pg_timeout.tenant_priorities: the share of the sessions of
+ * a role or a database evicted under pressure is divided by its priority.
+ */
+typedef struct PgTimeoutTenantPriority
+{
+	bool		is_role;		/* else a database */
+	char		name[NAMEDATALEN];
+	Oid			oid;			/* resolved when the policy is compiled */
+	double		priority;
+} PgTimeoutTenantPriority;
+
+/* pg_timeout.tenant_priorities once parsed by its check hook */
+typedef struct PgTimeoutTenantPriorities
+{
+	int			npriorities;
+	PgTimeoutTenantPriority priorities[MAX_TENANT_PRIORITIES];
+} PgTimeoutTenantPriorities;
+
+static PgTimeoutTenantPriorities *pg_timeout_tenant_priority_list = NULL;
+
+#define MAX_POLICY_RULES	32
+
+typedef enum
+{
+	RULE_DEFAULT,
+	RULE_ROLE,
+	RULE_DATABASE,
+	RULE_APPLICATION,
+	RULE_CIDR
+} PgTimeoutRuleKind;
+
+/*
+ * One entry of pg_timeout.policies, such as "role=bi:1h": the sessions it
+ * matches get its timeout, or are exempted.
+ */
+typedef struct PgTimeoutRule
+{
+	PgTimeoutRuleKind kind;
+	char		name[NAMEDATALEN];	/* role, database or application pattern */
+	Oid			oid;			/* resolved when the policy is compiled */
+	struct sockaddr_storage addr;	/* network of a cidr rule */
+	struct sockaddr_storage mask;
+	bool		exempt;
+	int64		timeout_ms;
+} PgTimeoutRule;
+
+/* pg_timeout.policies once parsed by its check hook */
+typedef struct PgTimeoutRules
+{
+	int			nrules;
+	PgTimeoutRule rules[MAX_POLICY_RULES];
+} PgTimeoutRules;
+
+static PgTimeoutRules *pg_timeout_rules = NULL;
+static PgTimeoutRules *pg_timeout_shadow_rules = NULL;
+
+/* room for a schema-qualified function name */
+#define POLICY_FUNCTION_LEN (NAMEDATALEN * 2 + 2)
+
+/*
+ * Policy compiled by the worker from the configuration.
+ */
+typedef struct PgTimeoutPolicy
+{
+	uint64		generation;		/* 0 until the worker has published one */
+	TimestampTz published;
+	int64		naptime_ms;
+	int64		min_naptime_ms;
+	double		max_cpu_percent;	/* 0 = checks every naptime */
+	int64		idle_session_timeout_ms;
+	char		policy_function[POLICY_FUNCTION_LEN];
+	int			pressure_threshold; /* percent of max_connections, 0 = off */
+	int64		pressure_min_idle_ms;
+	double		score_idle_weight;
+	double		score_memory_weight;
+	double		score_age_weight;
+	double		score_reconnect_weight;
+	int64		warning_time_ms;	/* before the timeout, 0 = off */
+	char		timezone[TZ_STRLEN_MAX + 1];	/* of the schedules */
+	int			nschedules;
+	PgTimeoutSchedule schedules[MAX_SCHEDULES];
+	int			max_idle_per_role;	/* 0 = no quota */
+	int			max_idle_per_database;
+	int64		sample_interval_ms; /* 0 = no sampling */
+	int			exemptions;		/* PG_TIMEOUT_EXEMPT_* flags */
+	int64		exempt_timeout_ms;	/* 0 = exempted sessions are kept */
+	int64		terminate_timeout_ms;	/* 0 = no warning */
+	int			pressure_selection;
+	int			ntenant_priorities;
+	PgTimeoutTenantPriority tenant_priorities[MAX_TENANT_PRIORITIES];
+	int64		standby_lag_threshold_ms;	/* 0 = off */
+	int64		temp_files_threshold_kb;	/* 0 = off */
+	char		host_segment[MAXPGPATH];	/* empty = no coordination */
+	int			host_memory_threshold;	/* percent of host memory, 0 = off */
+	int			nrules;
+	PgTimeoutRule rules[MAX_POLICY_RULES];
+	int			nshadow_rules;	/* 0 = no shadow evaluation */
+	PgTimeoutRule shadow_rules[MAX_POLICY_RULES];
+} PgTimeoutPolicy;
+
+/*
+ * Result of one pass over the backend status array.
+ */
+typedef struct PgTimeoutScan
+{
+	TimestampTz now;
+	PgTimeoutCandidate *candidates; /* idle client sessions */
+	int			ncandidates;
+	int			nclients;		/* client backends, whatever their state */
+	bool		schedule_active[MAX_SCHEDULES];
+	bool		in_xact;		/* a transaction has been started */
+	HTAB	   *idle_counts;	/* PgTimeoutIdleCount, NULL without quotas */
+} PgTimeoutScan;
+
+/*
+ * Number of idle sessions of a role (dbid is InvalidOid) or of a database
+ * (roleid is InvalidOid), counted during the scan for the quotas.
+ */
+typedef struct PgTimeoutIdleCountKey
+{
+	Oid			roleid;
+	Oid			dbid;
+} PgTimeoutIdleCountKey;
+
+typedef struct PgTimeoutIdleCount
+{
+	PgTimeoutIdleCountKey key;
+	int			count;
+} PgTimeoutIdleCount;
+
+/*
+ * Client group: sessions sharing role, database and application name.
+ * The worker keeps their reconnect rate across checks.
+ */
+typedef struct PgTimeoutGroupKey
+{
+	Oid			roleid;
+	Oid			dbid;
+	char		application_name[NAMEDATALEN];
+} PgTimeoutGroupKey;
+
+typedef struct PgTimeoutGroup
+{
+	PgTimeoutGroupKey key;
+	int			new_connections;	/* seen during the current scan */
+	double		reconnect_rate; /* smoothed, per minute */
+	TimestampTz last_seen;
+} PgTimeoutGroup;
+
+/*
+ * Session already warned of its termination, for the idle period starting
+ * at state_change.
+ */
+typedef struct PgTimeoutWarned
+{
+	int			pid;
+	TimestampTz state_change;
+	TimestampTz last_seen;
+} PgTimeoutWarned;
+
+/* channel of the pre-termination notifications */
+#define WARNING_CHANNEL "pg_timeout"
+
+/* window of the reconnect rate moving average, in seconds */
+#define RECONNECT_RATE_WINDOW	300.0
+
+/*
+ * Streaming quantile sketch with a relative error of (gamma - 1) / (gamma +
+ * 1), about 9%: bucket 0 counts the values under 1, bucket i > 0 the values
+ * in (gamma^(i-2), gamma^(i-1)].  Its size does not depend on the number of
+ * values, and the last bucket, around 10^10, is never reached by the values
+ * recorded, numbers of sessions and milliseconds.
+ */
+#define SKETCH_BUCKETS	128
+#define SKETCH_GAMMA	1.2
+
+typedef struct PgTimeoutSketch
+{
+	uint64		total;
+	double		max;
+	uint32		counts[SKETCH_BUCKETS];
+} PgTimeoutSketch;
+
+/*
+ * Database being drained by pg_timeout_drain(): its sessions are terminated
+ * as soon as they are idle until the deadline.  A free entry has an invalid
+ * dbid.
+ */
+typedef struct PgTimeoutDrain
+{
+	Oid			dbid;
+	int			requester;		/* pid of the caller, never terminated */
+	TimestampTz deadline;
+	int64		terminated;
+} PgTimeoutDrain;
+
+#define MAX_DRAINS			8
+
+/*
+ * Session on which pg_timeout.shadow_policies and the live decision
+ * differ.
+ */
+typedef struct PgTimeoutShadowDiff
+{
+	TimestampTz time;
+	int			pid;
+	Oid			roleid;
+	Oid			dbid;
+	char		application_name[NAMEDATALEN];
+	int64		idle_ms;
+	int64		live_timeout_ms;	/* -1 if exempt */
+	int64		shadow_timeout_ms;	/* -1 if exempt */
+	bool		shadow_terminate;	/* else only live terminated it */
+} PgTimeoutShadowDiff;
+
+#define MAX_SHADOW_DIFFS	128
+
+/*
+ * Entry of a cluster in the file of pg_timeout.host_segment, shared by the
+ * pg_timeout workers of all clusters of the host.
+ */
+typedef struct PgTimeoutHostSlot
+{
+	int32		postmaster_pid; /* 0 = free */
+	int32		idle_sessions;
+	TimestampTz updated;
+	int64		idle_memory_kb;
+	int64		evicting_kb;	/* freed by the last terminations */
+	int64		naptime_ms;		/* updated at least this often */
+	char		data_directory[256];
+} PgTimeoutHostSlot;
+
+#define MAX_HOST_CLUSTERS	64
+
+typedef struct PgTimeoutHostSegment
+{
+	uint32		magic;
+	uint32		version;
+	PgTimeoutHostSlot slots[MAX_HOST_CLUSTERS];
+} PgTimeoutHostSegment;
+
+#define HOST_SEGMENT_MAGIC		0x50475448	/* "PGTH" */
+#define HOST_SEGMENT_VERSION	2
+
+/* naptimes after which the entry of a cluster is considered gone */
+#define HOST_SLOT_STALE_NAPTIMES	3
+
+/* scan interval of the databases being drained */
+#define DRAIN_INTERVAL_MS	50
+
+/*
+ * State shared between the worker and the SQL functions.
+ *
+ * With PostgreSQL 17 and above it lives in a named DSM segment created by
+ * the first backend that needs it, so that the extension does not have to
+ * be preloaded.  With older releases it is allocated in the main shared
+ * memory segment and pg_timeout must be in shared_preload_libraries.
+ */
+typedef struct PgTimeoutSharedState
+{
+	LWLock		lock;			/* protects the fields below */
+	int			tranche_id;
+	pid_t		worker_pid;		/* 0 if no worker is running */
+	TimestampTz worker_start;
+	TimestampTz last_check;
+	int64		terminated;		/* sessions terminated since worker start */
+	int64		errors;			/* checks failed since worker start */
+	int			consecutive_errors;
+	TimestampTz last_error_time;
+	char		last_error[256];
+
+	/* check interval chosen for pg_timeout.max_cpu_percent */
+	int64		check_interval_ms;
+	double		check_cpu_ms;	/* smoothed CPU time of a check */
+	double		cpu_percent;	/* CPU used by the worker since last check */
+
+	/* sessions terminated whose process slot is released, or not yet */
+	int64		reclaimed;
+	int64		stuck;			/* over pg_timeout.terminate_timeout */
+	int			pending_terminations;
+	PgTimeoutSketch reclaim_latency;	/* in ms */
+
+	PgTimeoutDrain drains[MAX_DRAINS];
+
+	/*
+	 * Differences between pg_timeout.shadow_policies and the live decision,
+	 * counted once per idle period; the last ones are kept in a ring.
+	 */
+	int64		shadow_both;
+	int64		shadow_only;
+	int64		live_only;
+	uint64		shadow_count;	/* differences written since creation */
+	PgTimeoutShadowDiff shadow_diffs[MAX_SHADOW_DIFFS];
+
+	/*
+	 * The policy is double-buffered so that it can be read without taking
+	 * the lock: policy[policy_generation % 2] is the current version, and
+	 * policy_readers counts the readers of each buffer.  Only the worker
+	 * writes, into the other buffer, once it has no readers left.
+	 */
+	pg_atomic_uint64 policy_generation;
+	pg_atomic_uint32 policy_readers[2];
+	PgTimeoutPolicy policy[2];
+
+	/*
+	 * Ring of activity samples, following the shared state: sample n is
+	 * stored at n % history_size.  Protected by lock.
+	 */
+	int			history_size;
+	uint64		history_count;	/* samples written since creation */
+
+	/*
+	 * Time accounting of the client groups, following the history: only the
+	 * first naccounts of the max_accounts entries are used.  Protected by
+	 * lock.
+	 */
+	int			max_accounts;
+	int			naccounts;
+} PgTimeoutSharedState;
+
+/*
+ * State of one non-idle backend at a sampling time.
+ */
+typedef struct PgTimeoutSample
+{
+	TimestampTz sample_time;
+	int			pid;
+	Oid			roleid;
+	Oid			dbid;
+	BackendState state;
+	uint32		wait_event_info;
+	int64		query_id;
+} PgTimeoutSample;
+
+/*
+ * Cumulative time spent by the sessions of a client group in each state,
+ * in microseconds, and number of sessions seen.
+ */
+typedef struct PgTimeoutStateTimes
+{
+	int64		sessions;
+	int64		active_time;
+	int64		idle_time;
+	int64		idle_in_xact_time;
+} PgTimeoutStateTimes;
+
+typedef struct PgTimeoutAccount
+{
+	PgTimeoutGroupKey key;
+	PgTimeoutStateTimes times;
+	PgTimeoutSketch active;		/* sessions in use at each check */
+	PgTimeoutSketch idle_gaps;	/* idle time between two uses, in ms */
+} PgTimeoutAccount;
+
+#define pg_timeout_history(state) \
+	((PgTimeoutSample *) ((char *) (state) + MAXALIGN(sizeof(PgTimeoutSharedState))))
+#define pg_timeout_accounts(state) \
+	((PgTimeoutAccount *) ((char *) pg_timeout_history(state) + \
+						   MAXALIGN(sizeof(PgTimeoutSample) * (state)->history_size)))
+
+/*
+ * Times accounted by the worker since the last flush to the shared entry
+ * at slot, -1 if max_accounts was reached.
+ */
+typedef struct PgTimeoutAccountEntry
+{
+	PgTimeoutGroupKey key;
+	int			slot;
+	PgTimeoutStateTimes pending;
+	PgTimeoutSketch pending_gaps;
+	int			active;			/* sessions in use during the scan */
+	TimestampTz seen;			/* time of the last scan seeing the group */
+} PgTimeoutAccountEntry;
+
+/*
+ * Entries of groups not seen for that long are dropped by the worker; their
+ * shared entry is found again by key if the group comes back.
+ */
+#define ACCOUNT_FORGET_MS	(10 * 60 * 1000)
+
+/*
+ * Client backend followed by the time accounting: state and time at which
+ * it was last seen.
+ */
+typedef struct PgTimeoutBackend
+{
+	int			pid;
+	TimestampTz backend_start;
+	BackendState state;
+	TimestampTz state_start;
+	TimestampTz seen;
+} PgTimeoutBackend;
+
+/*
+ * Session signalled by the worker, followed until its process slot is
+ * released.
+ */
+typedef struct PgTimeoutPending
+{
+	int			pid;
+	TimestampTz backend_start;	/* to tell a recycled PID */
+	TimestampTz signalled;
+	TimestampTz verified;		/* last check once stuck */
+	bool		stuck;			/* over terminate_timeout */
+	bool		checked;		/* compared with the backends in this pass */
+	bool		recycled;		/* PID not found with backend_start */
+} PgTimeoutPending;
+
+/* poll interval of the sessions being terminated */
+#define VERIFY_INTERVAL_MS	10
+
+/*
+ * Time during which a session is polled every VERIFY_INTERVAL_MS when
+ * pg_timeout.terminate_timeout is 0; it is then checked at each naptime.
+ */
+#define VERIFY_FOLLOW_MS	(10 * 1000)
+
+/* wait event of a process, to find the one of each sampled backend */
+typedef struct PgTimeoutProcWait
+{
+	int			pid;
+	uint32		wait_event_info;
+} PgTimeoutProcWait;
+
+static PgTimeoutSharedState *pgts = NULL;
+
+/* policy in use by the worker, i.e. the last one it published */
+static PgTimeoutPolicy worker_policy;
+
+/* client groups known to the worker, and time of the previous scan */
+static HTAB *worker_groups = NULL;
+static TimestampTz worker_last_scan = 0;
+
+/* sessions warned of their termination */
+static HTAB *worker_warned = NULL;
+
+/* sessions already counted by the shadow evaluation, same entries */
+static HTAB *worker_shadowed = NULL;
+
+/* file of pg_timeout.host_segment mapped by the worker, NULL if none */
+#ifndef WIN32
+static PgTimeoutHostSegment *worker_host = NULL;
+static int	worker_host_fd = -1;
+static char worker_host_path[MAXPGPATH];	/* tried, even if it failed */
+#endif
+
+/* time accounting of the client groups and backends */
+static HTAB *worker_accounts = NULL;
+static HTAB *worker_backends = NULL;
+
+/* sessions signalled and still holding their process slot */
+static HTAB *worker_pending = NULL;
+static int	worker_pending_followed = 0;	/* polled every VERIFY_INTERVAL_MS */
+
+#if PG_VERSION_NUM < 170000
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#endif
+
 /*
  * Signal handler for SIGTERM
  *		Set a flag to let the main loop to terminate, and set our latch to wake
@@ -84,233 +710,5164 @@ pg_timeout_sighup(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
-Datum
-pg_timeout_main(PG_FUNCTION_ARGS)
+static Size
+pg_timeout_shmem_size(void)
 {
-	StringInfoData 	buf_select;
-	StringInfoData 	buf_kill;
+	Size		size;
 
-	char		*usename_val;
-	char		*datname_val;
-	char		*application_name_val;
-	char		*client_hostname_val;	
+	size = MAXALIGN(sizeof(PgTimeoutSharedState));
+	size = add_size(size, MAXALIGN(mul_size(pg_timeout_history_size,
+											sizeof(PgTimeoutSample))));
+	size = add_size(size, mul_size(pg_timeout_max_accounts,
+								   sizeof(PgTimeoutAccount)));
+	return size;
+}
 
-	/* Establish signal handlers before unblocking signals. */
-	pqsignal(SIGHUP, pg_timeout_sighup);
-	pqsignal(SIGTERM, pg_timeout_sigterm);
+/*
+ * Initialize a freshly allocated shared state.
+ */
+static void
+pg_timeout_init_state(void *ptr)
+{
+	PgTimeoutSharedState *state = (PgTimeoutSharedState *) ptr;
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+	memset(state, 0, pg_timeout_shmem_size());
+	state->tranche_id = LWLockNewTrancheId();
+	LWLockInitialize(&state->lock, state->tranche_id);
+	pg_atomic_init_u64(&state->policy_generation, 0);
+	pg_atomic_init_u32(&state->policy_readers[0], 0);
+	pg_atomic_init_u32(&state->policy_readers[1], 0);
+	state->history_size = pg_timeout_history_size;
+	state->max_accounts = pg_timeout_max_accounts;
+}
 
-	/* Connect to our database */
-#if PG_VERSION_NUM >=110000
-	BackgroundWorkerInitializeConnection("postgres", NULL, 0);
-#else
-	BackgroundWorkerInitializeConnection("postgres", NULL);
+#if PG_VERSION_NUM < 170000
+#if PG_VERSION_NUM >= 150000
+static void
+pg_timeout_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pg_timeout_shmem_size());
+}
 #endif
-	elog(LOG, "%s initialized", MyBgworkerEntry->bgw_name);
 
-	/*
-	 */
+static void
+pg_timeout_shmem_startup(void)
+{
+	bool		found;
 
-	/* In PG 9.5 and 9.6 only client backend are taken into account.
- 	*  In PG 10 and above, background workers are also taken into account 
- 	*  but with state and stage_change set to null:
- 	*  no need to filter on backend_type.
- 	*/
-	initStringInfo(&buf_select);
-	appendStringInfo(&buf_select,
-					"SELECT pid, usename, datname, application_name, client_hostname "
-    					"FROM pg_stat_activity "
-    					"WHERE pid <> pg_backend_pid() "
-      					"AND state = 'idle' "
-      					"AND state_change < current_timestamp - INTERVAL '%d' SECOND",
-					pg_timeout_idle_session_timeout
-					);
-	initStringInfo(&buf_kill);
-	appendStringInfo(&buf_kill,
-					"SELECT pg_terminate_backend(pid) "
-    					"FROM pg_stat_activity "
-    					"WHERE pid <> pg_backend_pid() "
-      					"AND state = 'idle' "
-      					"AND state_change < current_timestamp - INTERVAL '%d' SECOND",
-					pg_timeout_idle_session_timeout
-					);
-	/*
-	 * Main loop: do this until the SIGTERM handler tells us to terminate
-	 */
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
 
-	while (!got_sigterm)
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	pgts = ShmemInitStruct("pg_timeout", pg_timeout_shmem_size(), &found);
+	if (!found)
+		pg_timeout_init_state(pgts);
+	LWLockRelease(AddinShmemInitLock);
+}
+#endif
+
+/*
+ * Attach to the shared state, creating it if needed.
+ */
+static PgTimeoutSharedState *
+pg_timeout_attach(void)
+{
+	static bool tranche_registered = false;
+
+#if PG_VERSION_NUM >= 170000
+	if (pgts == NULL)
 	{
-		int			ret;
-		int			rc;
-		int			nr;
-		int			i;
+		bool		found;
 
-		/*
-		 * Background workers mustn't call usleep() or any direct equivalent:
-		 * instead, they may wait on their process latch, which sleeps as
-		 * necessary, but is awakened if postmaster dies.  That way the
-		 * background process goes away immediately in an emergency.
-		 */
-#if PG_VERSION_NUM >= 100000
-		rc = WaitLatch(MyLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pg_timeout_naptime * 1000L,
-					   PG_WAIT_EXTENSION);
+		pgts = GetNamedDSMSegment("pg_timeout", pg_timeout_shmem_size(),
+								  pg_timeout_init_state, &found);
+	}
 #else
-		rc = WaitLatch(MyLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pg_timeout_naptime * 1000L);
+	if (pgts == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_timeout must be loaded via shared_preload_libraries")));
 #endif
-		ResetLatch(MyLatch);
-
-		/* emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
-
-		CHECK_FOR_INTERRUPTS();
 
-		/*
-		 * In case of a SIGHUP, just reload the configuration.
-		 */
-		if (got_sighup)
-		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
-		}
+	if (!tranche_registered)
+	{
+		LWLockRegisterTranche(pgts->tranche_id, "pg_timeout");
+		tranche_registered = true;
+	}
 
-		/*
-		 * Start a transaction on which we can run queries.  Note that each
-		 * StartTransactionCommand() call should be preceded by a
-		 * SetCurrentStatementStartTimestamp() call, which sets both the time
-		 * for the statement we're about the run, and also the transaction
-		 * start time.  Also, each other query sent to SPI should probably be
-		 * preceded by SetCurrentStatementStartTimestamp(), so that statement
-		 * start time is always up to date.
-		 *
-		 * The SPI_connect() call lets us run queries through the SPI manager,
-		 * and the PushActiveSnapshot() call creates an "active" snapshot
-		 * which is necessary for queries to have MVCC data to work on.
-		 *
-		 * The pgstat_report_activity() call makes our activity visible
-		 * through the pgstat views.
-		 */
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
-		pgstat_report_activity(STATE_RUNNING, buf_select.data);
-
-		/* We can now execute queries via SPI */
-		ret = SPI_execute(buf_select.data, false, 0);
-
-		if (ret != SPI_OK_SELECT)
-			elog(FATAL, "cannot select from pg_stat_activity: error code %d",
-				     ret);
-		nr = SPI_processed;		
-
-		i = 0;
-		for (i = 0; i < nr; i++)
-		{
-			bool		isnull;
-			int32		pid_val;
-
-			pid_val = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i],
-							  SPI_tuptable->tupdesc,
-							  1, &isnull));
-			if (!isnull)
-			{
-				usename_val = SPI_getvalue(SPI_tuptable->vals[i],
-							    SPI_tuptable->tupdesc,
-							    2);
-				datname_val = SPI_getvalue(SPI_tuptable->vals[i],
-							    SPI_tuptable->tupdesc,
-							    3);
-				application_name_val = SPI_getvalue(SPI_tuptable->vals[i],
-							    SPI_tuptable->tupdesc,
-							    4);
-				client_hostname_val = SPI_getvalue(SPI_tuptable->vals[i],
-							    SPI_tuptable->tupdesc,
-							    5);
-				/* 
-  				* client_hostname_val is NULL pointer because column client_hostname is null.
-  				*/
-				if (usename_val == NULL)
-					usename_val = null_value;
-				if (datname_val == NULL)
-					datname_val = null_value;
-				if (application_name_val == NULL)
-					client_hostname_val = null_value;
-				if (client_hostname_val == NULL)
-					client_hostname_val = null_value;
-				
-					elog(LOG, LOG_MESSAGE, 
-						 MyBgworkerEntry->bgw_name, pid_val, usename_val,
-                	                         datname_val, application_name_val, 
-                        	                 client_hostname_val);
-			}
-			else	elog(WARNING, "%s: pid is NULL",
-					 MyBgworkerEntry->bgw_name);
-		}
+	return pgts;
+}
 
-		if (nr > 0)
-		{
-			ret = SPI_execute(buf_kill.data, false, 0);
-			if (ret != SPI_OK_SELECT)
-				elog(FATAL, "cannot select pg_terminate_backend: error code %d",
-					     ret);
+/*
+ * Look up the roles and databases of the entries of pg_timeout.policies or
+ * pg_timeout.shadow_policies.  Must be called in a transaction.
+ */
+static void
+pg_timeout_resolve_rules(PgTimeoutRule *rules, int nrules, const char *name)
+{
+	int			i;
 
-			elog(LOG, "%s: idle session(s) since %d seconds terminated", 
-				  MyBgworkerEntry->bgw_name,
-        	                  pg_timeout_idle_session_timeout);
-		}
+	for (i = 0; i < nrules; i++)
+	{
+		PgTimeoutRule *rule = &rules[i];
 
-		/*
-		 * And finish our transaction.
-		 */
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-		pgstat_report_stat(false);
-		pgstat_report_activity(STATE_IDLE, NULL);
+		if (rule->kind == RULE_ROLE)
+			rule->oid = get_role_oid(rule->name, true);
+		else if (rule->kind == RULE_DATABASE)
+			rule->oid = get_database_oid(rule->name, true);
+		else
+			continue;
+		if (!OidIsValid(rule->oid))
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("%s \"%s\" of %s entry %d does not exist",
+							rule->kind == RULE_ROLE ? "role" : "database",
+							rule->name, name, i + 1)));
 	}
-
-	proc_exit(1);
 }
 
 /*
- * Entrypoint of this module.
- *
+ * Build the policy from the current configuration.  Must be called in a
+ * transaction.
  */
-void
-_PG_init(void)
+static void
+pg_timeout_compile_policy(PgTimeoutPolicy *policy)
 {
-	BackgroundWorker worker;
+	int			i;
 
-	/* get the configuration */
-	DefineCustomIntVariable("pg_timeout.naptime",
-							"Duration between each check (in seconds).",
-							NULL,
-							&pg_timeout_naptime,
-							10,
-							1,
-							INT_MAX,
-							PGC_SIGHUP,
-							0,
-							NULL,
+	memset(policy, 0, sizeof(PgTimeoutPolicy));
+	policy->naptime_ms = (int64) rint(pg_timeout_naptime * 1000.0);
+	policy->min_naptime_ms = Min((int64) rint(pg_timeout_min_naptime * 1000.0),
+								 policy->naptime_ms);
+	policy->max_cpu_percent = pg_timeout_max_cpu_percent;
+	policy->idle_session_timeout_ms = (int64) rint(pg_timeout_idle_session_timeout * 1000.0);
+	strlcpy(policy->policy_function, pg_timeout_policy_function,
+			sizeof(policy->policy_function));
+	policy->pressure_threshold = pg_timeout_pressure_threshold;
+	policy->pressure_min_idle_ms = (int64) rint(pg_timeout_pressure_min_idle * 1000.0);
+	policy->score_idle_weight = pg_timeout_score_idle_weight;
+	policy->score_memory_weight = pg_timeout_score_memory_weight;
+	policy->score_age_weight = pg_timeout_score_age_weight;
+	policy->score_reconnect_weight = pg_timeout_score_reconnect_weight;
+	policy->warning_time_ms = (int64) rint(pg_timeout_warning_time * 1000.0);
+	policy->max_idle_per_role = pg_timeout_max_idle_per_role;
+	policy->max_idle_per_database = pg_timeout_max_idle_per_database;
+	policy->sample_interval_ms = (int64) rint(pg_timeout_sample_interval * 1000.0);
+	policy->exemptions = pg_timeout_exemption_flags;
+	policy->exempt_timeout_ms = (int64) rint(pg_timeout_exempt_idle_session_timeout * 1000.0);
+	policy->terminate_timeout_ms = (int64) rint(pg_timeout_terminate_timeout * 1000.0);
+	policy->pressure_selection = pg_timeout_pressure_selection;
+	policy->standby_lag_threshold_ms = (int64) rint(pg_timeout_standby_lag_threshold * 1000.0);
+	policy->temp_files_threshold_kb = pg_timeout_temp_files_threshold;
+	strlcpy(policy->host_segment, pg_timeout_host_segment,
+			sizeof(policy->host_segment));
+	policy->host_memory_threshold = pg_timeout_host_memory_threshold;
+	if (pg_timeout_rules != NULL)
+	{
+		policy->nrules = pg_timeout_rules->nrules;
+		memcpy(policy->rules, pg_timeout_rules->rules,
+			   sizeof(PgTimeoutRule) * policy->nrules);
+	}
+	if (pg_timeout_shadow_rules != NULL)
+	{
+		policy->nshadow_rules = pg_timeout_shadow_rules->nrules;
+		memcpy(policy->shadow_rules, pg_timeout_shadow_rules->rules,
+			   sizeof(PgTimeoutRule) * policy->nshadow_rules);
+	}
+	if (pg_timeout_tenant_priority_list != NULL)
+	{
+		policy->ntenant_priorities = pg_timeout_tenant_priority_list->npriorities;
+		memcpy(policy->tenant_priorities,
+			   pg_timeout_tenant_priority_list->priorities,
+			   sizeof(PgTimeoutTenantPriority) * policy->ntenant_priorities);
+	}
+	strlcpy(policy->timezone, pg_timeout_schedule_timezone,
+			sizeof(policy->timezone));
+	if (pg_timeout_schedules != NULL)
+	{
+		policy->nschedules = pg_timeout_schedules->nschedules;
+		memcpy(policy->schedules, pg_timeout_schedules->schedules,
+			   sizeof(PgTimeoutSchedule) * policy->nschedules);
+	}
+
+	/* role names are only looked up once per reload */
+	for (i = 0; i < policy->nschedules; i++)
+	{
+		PgTimeoutSchedule *schedule = &policy->schedules[i];
+
+		if (schedule->role[0] == '\0')
+			continue;
+		schedule->roleid = get_role_oid(schedule->role, true);
+		if (!OidIsValid(schedule->roleid))
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("role \"%s\" of pg_timeout.schedule entry %d does not exist",
+							schedule->role, i + 1)));
+	}
+
+	pg_timeout_resolve_rules(policy->rules, policy->nrules,
+							 "pg_timeout.policies");
+	pg_timeout_resolve_rules(policy->shadow_rules, policy->nshadow_rules,
+							 "pg_timeout.shadow_policies");
+
+	for (i = 0; i < policy->ntenant_priorities; i++)
+	{
+		PgTimeoutTenantPriority *tenant = &policy->tenant_priorities[i];
+
+		if (tenant->is_role)
+			tenant->oid = get_role_oid(tenant->name, true);
+		else
+			tenant->oid = get_database_oid(tenant->name, true);
+		if (!OidIsValid(tenant->oid))
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("%s \"%s\" of pg_timeout.tenant_priorities entry %d does not exist",
+							tenant->is_role ? "role" : "database",
+							tenant->name, i + 1)));
+	}
+}
+
+/*
+ * Make a new policy visible to readers.  Only called by the worker.
+ */
+static void
+pg_timeout_publish_policy(PgTimeoutPolicy *policy)
+{
+	uint64		generation = pg_atomic_read_u64(&pgts->policy_generation) + 1;
+	int			idx = generation % 2;
+
+	/* wait for the readers of the version before the current one */
+	while (pg_atomic_read_u32(&pgts->policy_readers[idx]) != 0)
+		pg_spin_delay();
+	pg_memory_barrier();
+
+	policy->generation = generation;
+	policy->published = GetCurrentTimestamp();
+	memcpy(&pgts->policy[idx], policy, sizeof(PgTimeoutPolicy));
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&pgts->policy_generation, generation);
+}
+
+/*
+ * Compile the policy from the configuration and publish it.
+ */
+static void
+pg_timeout_reload_policy(void)
+{
+	PgTimeoutPolicy policy;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pg_timeout_compile_policy(&policy);
+	CommitTransactionCommand();
+
+	/*
+	 * Only reached if compiling succeeded: an error (a role or database
+	 * lookup, say) jumps to the error handler of the main loop, which aborts
+	 * the transaction, so the previous policy stays in use until the next
+	 * reload.  At startup, the worker exits and is restarted instead.
+	 */
+	worker_policy = policy;
+	pg_timeout_publish_policy(&worker_policy);
+}
+
+/*
+ * Copy the current policy without locking.
+ *
+ * The reader registers on the buffer of the generation it has read, then
+ * checks that this generation is still current: if so the worker cannot
+ * overwrite the buffer until the reader is gone.
+ */
+static void
+pg_timeout_read_policy(PgTimeoutPolicy *policy)
+{
+	for (;;)
+	{
+		uint64		generation = pg_atomic_read_u64(&pgts->policy_generation);
+		int			idx = generation % 2;
+
+		pg_atomic_fetch_add_u32(&pgts->policy_readers[idx], 1);
+		if (pg_atomic_read_u64(&pgts->policy_generation) == generation)
+		{
+			memcpy(policy, &pgts->policy[idx], sizeof(PgTimeoutPolicy));
+			pg_atomic_fetch_sub_u32(&pgts->policy_readers[idx], 1);
+			return;
+		}
+		pg_atomic_fetch_sub_u32(&pgts->policy_readers[idx], 1);
+	}
+}
+
+static bool
+pg_timeout_check_policy_function(char **newval, void **extra, GucSource source)
+{
+	if (strlen(*newval) >= POLICY_FUNCTION_LEN)
+	{
+		GUC_check_errdetail("Function name is too long.");
+		return false;
+	}
+	return true;
+}
+
+static const char *const day_names[7] = {
+	"sun", "mon", "tue", "wed", "thu", "fri", "sat"
+};
+
+static int
+pg_timeout_parse_day(const char *str, size_t len)
+{
+	int			i;
+
+	for (i = 0; i < 7; i++)
+		if (len == 3 && pg_strncasecmp(str, day_names[i], 3) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Parse "*" or a comma-separated list of days and day ranges, such as
+ * "mon-fri" or "sat,sun".
+ */
+static bool
+pg_timeout_parse_days(char *str, uint8 *days)
+{
+	char	   *item;
+	char	   *saveptr;
+
+	*days = 0;
+	if (strcmp(str, "*") == 0)
+	{
+		*days = 0x7F;
+		return true;
+	}
+
+	for (item = strtok_r(str, ",", &saveptr); item != NULL;
+		 item = strtok_r(NULL, ",", &saveptr))
+	{
+		char	   *dash = strchr(item, '-');
+		int			first;
+		int			last;
+		int			d;
+
+		if (dash != NULL)
+		{
+			first = pg_timeout_parse_day(item, dash - item);
+			last = pg_timeout_parse_day(dash + 1, strlen(dash + 1));
+		}
+		else
+			first = last = pg_timeout_parse_day(item, strlen(item));
+		if (first < 0 || last < 0)
+			return false;
+
+		for (d = first;; d = (d + 1) % 7)
+		{
+			*days |= 1 << d;
+			if (d == last)
+				break;
+		}
+	}
+
+	return *days != 0;
+}
+
+/*
+ * Parse "HH:MM", from 00:00 to 24:00.
+ */
+static bool
+pg_timeout_parse_time(const char *str, int *minutes)
+{
+	int			hours;
+	int			mins;
+	char		extra;
+
+	if (sscanf(str, "%d:%d%c", &hours, &mins, &extra) != 2)
+		return false;
+	if (hours < 0 || hours > 24 || mins < 0 || mins > 59 ||
+		(hours == 24 && mins != 0))
+		return false;
+
+	*minutes = hours * 60 + mins;
+	return true;
+}
+
+/*
+ * Parse the timeout of a schedule or policy entry, in seconds if no unit
+ * is given.  Besides the units of the GUCs, "m" is accepted for minutes, as
+ * in "10m".
+ */
+static bool
+pg_timeout_parse_timeout(const char *str, int64 *timeout_ms)
+{
+	size_t		len = strlen(str);
+	char	   *value;
+	double		timeout;
+	bool		ok;
+
+	if (len > 0 && str[len - 1] == 'm')
+		value = psprintf("%sin", str);
+	else
+		value = pstrdup(str);
+
+	ok = parse_real(value, &timeout, GUC_UNIT_S, NULL) &&
+		timeout >= 0.001 && timeout <= INT_MAX;
+	pfree(value);
+	if (!ok)
+		return false;
+
+	*timeout_ms = (int64) rint(timeout * 1000.0);
+	return true;
+}
+
+/*
+ * Parse pg_timeout.schedule, a semicolon-separated list of entries such as
+ * "mon-fri 08:00-18:00 role=bi 15min".  Called from the check hook, so
+ * errors are reported with GUC_check_errdetail().
+ */
+static bool
+pg_timeout_parse_schedules(const char *value, PgTimeoutSchedules *result)
+{
+	char	   *copy = pstrdup(value);
+	char	   *entry;
+	char	   *saveptr;
+
+	result->nschedules = 0;
+
+	for (entry = strtok_r(copy, ";", &saveptr); entry != NULL;
+		 entry = strtok_r(NULL, ";", &saveptr))
+	{
+		PgTimeoutSchedule *schedule;
+		char	   *tokens[4];
+		int			ntokens = 0;
+		char	   *token;
+		char	   *tokptr;
+		char	   *dash;
+		int			end;
+
+		for (token = strtok_r(entry, " \t\n", &tokptr); token != NULL;
+			 token = strtok_r(NULL, " \t\n", &tokptr))
+		{
+			if (ntokens == lengthof(tokens))
+			{
+				GUC_check_errdetail("Too many fields in schedule entry %d.",
+									result->nschedules + 1);
+				pfree(copy);
+				return false;
+			}
+			tokens[ntokens++] = token;
+		}
+		if (ntokens == 0)
+			continue;
+		if (ntokens < 3)
+		{
+			GUC_check_errdetail("Schedule entry %d must have days, a time window and a timeout.",
+								result->nschedules + 1);
+			pfree(copy);
+			return false;
+		}
+		if (result->nschedules == MAX_SCHEDULES)
+		{
+			GUC_check_errdetail("At most %d schedule entries are allowed.",
+								MAX_SCHEDULES);
+			pfree(copy);
+			return false;
+		}
+
+		schedule = &result->schedules[result->nschedules];
+		memset(schedule, 0, sizeof(PgTimeoutSchedule));
+
+		if (!pg_timeout_parse_days(tokens[0], &schedule->days))
+		{
+			GUC_check_errdetail("Invalid days \"%s\" in schedule entry %d.",
+								tokens[0], result->nschedules + 1);
+			pfree(copy);
+			return false;
+		}
+
+		dash = strchr(tokens[1], '-');
+		if (dash != NULL)
+			*dash = '\0';
+		if (dash == NULL ||
+			!pg_timeout_parse_time(tokens[1], &schedule->start) ||
+			!pg_timeout_parse_time(dash + 1, &end) ||
+			schedule->start == MINUTES_PER_DAY)
+		{
+			GUC_check_errdetail("Invalid time window in schedule entry %d.",
+								result->nschedules + 1);
+			pfree(copy);
+			return false;
+		}
+		if (end > schedule->start)
+			schedule->length = end - schedule->start;
+		else
+			schedule->length = end + MINUTES_PER_DAY - schedule->start;
+
+		if (ntokens == 4)
+		{
+			if (strncmp(tokens[2], "role=", 5) != 0 ||
+				tokens[2][5] == '\0' ||
+				strlen(tokens[2] + 5) >= NAMEDATALEN)
+			{
+				GUC_check_errdetail("Invalid role \"%s\" in schedule entry %d.",
+									tokens[2], result->nschedules + 1);
+				pfree(copy);
+				return false;
+			}
+			strlcpy(schedule->role, tokens[2] + 5, NAMEDATALEN);
+		}
+
+		if (!pg_timeout_parse_timeout(tokens[ntokens - 1], &schedule->timeout_ms))
+		{
+			GUC_check_errdetail("Invalid timeout \"%s\" in schedule entry %d.",
+								tokens[ntokens - 1], result->nschedules + 1);
+			pfree(copy);
+			return false;
+		}
+
+		result->nschedules++;
+	}
+
+	pfree(copy);
+	return true;
+}
+
+static bool
+pg_timeout_check_schedule(char **newval, void **extra, GucSource source)
+{
+	PgTimeoutSchedules *schedules;
+
+	schedules = (PgTimeoutSchedules *) malloc(sizeof(PgTimeoutSchedules));
+	if (schedules == NULL)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		return false;
+	}
+
+	if (!pg_timeout_parse_schedules(*newval, schedules))
+	{
+		free(schedules);
+		return false;
+	}
+
+	*extra = schedules;
+	return true;
+}
+
+static void
+pg_timeout_assign_schedule(const char *newval, void *extra)
+{
+	pg_timeout_schedules = (PgTimeoutSchedules *) extra;
+}
+
+static bool
+pg_timeout_check_timezone(char **newval, void **extra, GucSource source)
+{
+	if (**newval != '\0' && pg_tzset(*newval) == NULL)
+	{
+		GUC_check_errdetail("Time zone \"%s\" is not recognized.", *newval);
+		return false;
+	}
+	return true;
+}
+
+static bool
+pg_timeout_check_exemptions(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *l;
+	int			flags = 0;
+	int		   *myextra;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		char	   *name = (char *) lfirst(l);
+
+		if (strcmp(name, "listen") == 0)
+			flags |= PG_TIMEOUT_EXEMPT_LISTEN;
+		else if (strcmp(name, "advisory_lock") == 0)
+			flags |= PG_TIMEOUT_EXEMPT_ADVISORY_LOCK;
+		else if (strcmp(name, "temp_table") == 0)
+			flags |= PG_TIMEOUT_EXEMPT_TEMP_TABLE;
+		else
+		{
+			GUC_check_errdetail("Unrecognized exemption \"%s\".", name);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+	}
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+	myextra = (int *) malloc(sizeof(int));
+	if (myextra == NULL)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		return false;
+	}
+	*myextra = flags;
+	*extra = myextra;
+	return true;
+}
+
+static void
+pg_timeout_assign_exemptions(const char *newval, void *extra)
+{
+	pg_timeout_exemption_flags = *((int *) extra);
+}
+
+/*
+ * Parse pg_timeout.tenant_priorities, a semicolon-separated list of entries
+ * such as "role=bi 0.5" or "database=shop 2".  Called from the check hook.
+ */
+static bool
+pg_timeout_parse_tenant_priorities(const char *value,
+								   PgTimeoutTenantPriorities *result)
+{
+	char	   *copy = pstrdup(value);
+	char	   *entry;
+	char	   *saveptr;
+
+	result->npriorities = 0;
+
+	for (entry = strtok_r(copy, ";", &saveptr); entry != NULL;
+		 entry = strtok_r(NULL, ";", &saveptr))
+	{
+		PgTimeoutTenantPriority *tenant;
+		char	   *tokens[2];
+		int			ntokens = 0;
+		char	   *token;
+		char	   *tokptr;
+		char	   *name;
+		char	   *end;
+
+		for (token = strtok_r(entry, " \t\n", &tokptr); token != NULL;
+			 token = strtok_r(NULL, " \t\n", &tokptr))
+		{
+			if (ntokens == lengthof(tokens))
+			{
+				GUC_check_errdetail("Too many fields in tenant priority entry %d.",
+									result->npriorities + 1);
+				pfree(copy);
+				return false;
+			}
+			tokens[ntokens++] = token;
+		}
+		if (ntokens == 0)
+			continue;
+		if (ntokens < 2)
+		{
+			GUC_check_errdetail("Tenant priority entry %d must have a role or a database and a priority.",
+								result->npriorities + 1);
+			pfree(copy);
+			return false;
+		}
+		if (result->npriorities == MAX_TENANT_PRIORITIES)
+		{
+			GUC_check_errdetail("At most %d tenant priority entries are allowed.",
+								MAX_TENANT_PRIORITIES);
+			pfree(copy);
+			return false;
+		}
+
+		tenant = &result->priorities[result->npriorities];
+		memset(tenant, 0, sizeof(PgTimeoutTenantPriority));
+
+		if (strncmp(tokens[0], "role=", 5) == 0)
+		{
+			tenant->is_role = true;
+			name = tokens[0] + 5;
+		}
+		else if (strncmp(tokens[0], "database=", 9) == 0)
+			name = tokens[0] + 9;
+		else
+			name = NULL;
+		if (name == NULL || name[0] == '\0' || strlen(name) >= NAMEDATALEN)
+		{
+			GUC_check_errdetail("Invalid role or database \"%s\" in tenant priority entry %d.",
+								tokens[0], result->npriorities + 1);
+			pfree(copy);
+			return false;
+		}
+		strlcpy(tenant->name, name, NAMEDATALEN);
+
+		tenant->priority = strtod(tokens[1], &end);
+		if (*end != '\0' || !(tenant->priority > 0.0) || isinf(tenant->priority))
+		{
+			GUC_check_errdetail("Invalid priority \"%s\" in tenant priority entry %d.",
+								tokens[1], result->npriorities + 1);
+			pfree(copy);
+			return false;
+		}
+
+		result->npriorities++;
+	}
+
+	pfree(copy);
+	return true;
+}
+
+static bool
+pg_timeout_check_tenant_priorities(char **newval, void **extra, GucSource source)
+{
+	PgTimeoutTenantPriorities *priorities;
+
+	priorities = (PgTimeoutTenantPriorities *) malloc(sizeof(PgTimeoutTenantPriorities));
+	if (priorities == NULL)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		return false;
+	}
+
+	if (!pg_timeout_parse_tenant_priorities(*newval, priorities))
+	{
+		free(priorities);
+		return false;
+	}
+
+	*extra = priorities;
+	return true;
+}
+
+static void
+pg_timeout_assign_tenant_priorities(const char *newval, void *extra)
+{
+	pg_timeout_tenant_priority_list = (PgTimeoutTenantPriorities *) extra;
+}
+
+static char *
+pg_timeout_trim(char *str)
+{
+	char	   *end;
+
+	while (isspace((unsigned char) *str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char) end[-1]))
+		*--end = '\0';
+
+	return str;
+}
+
+/*
+ * Parse the network of a cidr rule, an address with an optional number of
+ * bits, like pg_hba.conf does.
+ */
+static bool
+pg_timeout_parse_cidr(char *value, PgTimeoutRule *rule)
+{
+	struct addrinfo hints;
+	struct addrinfo *gai_result = NULL;
+	char	   *bits;
+	int			ret;
+
+	bits = strchr(value, '/');
+	if (bits != NULL)
+		*bits++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = AF_UNSPEC;
+	ret = pg_getaddrinfo_all(value, NULL, &hints, &gai_result);
+	if (ret != 0 || gai_result == NULL)
+	{
+		if (gai_result)
+			pg_freeaddrinfo_all(hints.ai_family, gai_result);
+		return false;
+	}
+
+	memcpy(&rule->addr, gai_result->ai_addr, gai_result->ai_addrlen);
+	pg_freeaddrinfo_all(hints.ai_family, gai_result);
+
+	return pg_sockaddr_cidr_mask(&rule->mask, bits, rule->addr.ss_family) == 0;
+}
+
+/*
+ * Parse pg_timeout.policies, a semicolon-separated list of entries such as
+ * "role=bi:1h", "app=psql*:10m", "cidr=10.1.0.0/16:exempt" or
+ * "default:60s".  Called from the check hook.
+ */
+static bool
+pg_timeout_parse_rules(const char *value, PgTimeoutRules *result)
+{
+	char	   *copy = pstrdup(value);
+	char	   *entry;
+	char	   *saveptr;
+
+	result->nrules = 0;
+
+	for (entry = strtok_r(copy, ";", &saveptr); entry != NULL;
+		 entry = strtok_r(NULL, ";", &saveptr))
+	{
+		PgTimeoutRule *rule;
+		char	   *action;
+		char	   *name = NULL;
+
+		entry = pg_timeout_trim(entry);
+		if (*entry == '\0')
+			continue;
+
+		if (result->nrules == MAX_POLICY_RULES)
+		{
+			GUC_check_errdetail("At most %d policy entries are allowed.",
+								MAX_POLICY_RULES);
+			pfree(copy);
+			return false;
+		}
+
+		/* the last colon, as IPv6 addresses have some */
+		action = strrchr(entry, ':');
+		if (action == NULL)
+		{
+			GUC_check_errdetail("Policy entry %d must be <match>:<timeout> or <match>:exempt.",
+								result->nrules + 1);
+			pfree(copy);
+			return false;
+		}
+		*action++ = '\0';
+		entry = pg_timeout_trim(entry);
+		action = pg_timeout_trim(action);
+
+		rule = &result->rules[result->nrules];
+		memset(rule, 0, sizeof(PgTimeoutRule));
+
+		if (strcmp(entry, "default") == 0)
+			rule->kind = RULE_DEFAULT;
+		else if (strncmp(entry, "role=", 5) == 0)
+		{
+			rule->kind = RULE_ROLE;
+			name = entry + 5;
+		}
+		else if (strncmp(entry, "db=", 3) == 0)
+		{
+			rule->kind = RULE_DATABASE;
+			name = entry + 3;
+		}
+		else if (strncmp(entry, "app=", 4) == 0)
+		{
+			rule->kind = RULE_APPLICATION;
+			name = entry + 4;
+		}
+		else if (strncmp(entry, "cidr=", 5) == 0)
+		{
+			rule->kind = RULE_CIDR;
+			if (!pg_timeout_parse_cidr(entry + 5, rule))
+			{
+				GUC_check_errdetail("Invalid network \"%s\" in policy entry %d.",
+									entry + 5, result->nrules + 1);
+				pfree(copy);
+				return false;
+			}
+		}
+		else
+		{
+			GUC_check_errdetail("Unrecognized match \"%s\" in policy entry %d.",
+								entry, result->nrules + 1);
+			pfree(copy);
+			return false;
+		}
+
+		if (name != NULL)
+		{
+			if (name[0] == '\0' || strlen(name) >= NAMEDATALEN)
+			{
+				GUC_check_errdetail("Invalid name \"%s\" in policy entry %d.",
+									name, result->nrules + 1);
+				pfree(copy);
+				return false;
+			}
+			strlcpy(rule->name, name, NAMEDATALEN);
+		}
+
+		if (strcmp(action, "exempt") == 0)
+			rule->exempt = true;
+		else if (!pg_timeout_parse_timeout(action, &rule->timeout_ms))
+		{
+			GUC_check_errdetail("Invalid timeout \"%s\" in policy entry %d.",
+								action, result->nrules + 1);
+			pfree(copy);
+			return false;
+		}
+
+		result->nrules++;
+	}
+
+	pfree(copy);
+	return true;
+}
+
+static bool
+pg_timeout_check_policies(char **newval, void **extra, GucSource source)
+{
+	PgTimeoutRules *rules;
+
+	rules = (PgTimeoutRules *) malloc(sizeof(PgTimeoutRules));
+	if (rules == NULL)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		return false;
+	}
+
+	if (!pg_timeout_parse_rules(*newval, rules))
+	{
+		free(rules);
+		return false;
+	}
+
+	*extra = rules;
+	return true;
+}
+
+static void
+pg_timeout_assign_policies(const char *newval, void *extra)
+{
+	pg_timeout_rules = (PgTimeoutRules *) extra;
+}
+
+static void
+pg_timeout_assign_shadow_policies(const char *newval, void *extra)
+{
+	pg_timeout_shadow_rules = (PgTimeoutRules *) extra;
+}
+
+/*
+ * Local time of the schedules, as minutes since Sunday midnight and
+ * microseconds since the start of the minute.
+ */
+static int
+pg_timeout_minute_of_week(TimestampTz now, int64 *usecs)
+{
+	pg_time_t	t = timestamptz_to_time_t(now);
+	pg_tz	   *tz = NULL;
+	struct pg_tm *tm;
+
+	if (worker_policy.timezone[0] != '\0')
+		tz = pg_tzset(worker_policy.timezone);
+	if (tz == NULL)
+		tz = session_timezone;
+
+	tm = pg_localtime(&t, tz);
+	if (usecs != NULL)
+		*usecs = tm->tm_sec * USECS_PER_SEC + now % USECS_PER_SEC;
+
+	return tm->tm_wday * MINUTES_PER_DAY + tm->tm_hour * 60 + tm->tm_min;
+}
+
+static bool
+pg_timeout_schedule_active(const PgTimeoutSchedule *schedule, int minute)
+{
+	int			d;
+
+	for (d = 0; d < 7; d++)
+	{
+		int			start = d * MINUTES_PER_DAY + schedule->start;
+
+		if ((schedule->days & (1 << d)) != 0 &&
+			(minute - start + MINUTES_PER_WEEK) % MINUTES_PER_WEEK < schedule->length)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Milliseconds until the next start or end of a schedule window, -1 if
+ * there is no schedule.  The worker wakes up then to apply the new
+ * timeouts.
+ */
+static long
+pg_timeout_next_schedule_boundary(TimestampTz now)
+{
+	int			minute;
+	int64		usecs;
+	int			best = MINUTES_PER_WEEK;
+	int			i;
+	int			d;
+
+	if (worker_policy.nschedules == 0)
+		return -1;
+
+	minute = pg_timeout_minute_of_week(now, &usecs);
+
+	for (i = 0; i < worker_policy.nschedules; i++)
+	{
+		PgTimeoutSchedule *schedule = &worker_policy.schedules[i];
+
+		for (d = 0; d < 7; d++)
+		{
+			int			bounds[2];
+			int			b;
+
+			if ((schedule->days & (1 << d)) == 0)
+				continue;
+
+			bounds[0] = d * MINUTES_PER_DAY + schedule->start;
+			bounds[1] = (bounds[0] + schedule->length) % MINUTES_PER_WEEK;
+			for (b = 0; b < 2; b++)
+			{
+				int			delta = (bounds[b] - minute + MINUTES_PER_WEEK) % MINUTES_PER_WEEK;
+
+				if (delta == 0)
+					delta = MINUTES_PER_WEEK;
+				best = Min(best, delta);
+			}
+		}
+	}
+
+	return (long) ((best * 60 * USECS_PER_SEC - usecs) / 1000) + 1;
+}
+
+/*
+ * Find the schedule entries active at the time of the scan.
+ */
+static void
+pg_timeout_resolve_schedules(PgTimeoutScan *scan)
+{
+	int			minute;
+	int			i;
+
+	if (worker_policy.nschedules == 0)
+		return;
+
+	minute = pg_timeout_minute_of_week(scan->now, NULL);
+	for (i = 0; i < worker_policy.nschedules; i++)
+	{
+		PgTimeoutSchedule *schedule = &worker_policy.schedules[i];
+
+		scan->schedule_active[i] =
+			(schedule->role[0] == '\0' || OidIsValid(schedule->roleid)) &&
+			pg_timeout_schedule_active(schedule, minute);
+	}
+}
+
+/*
+ * Match an application name against a pattern where * stands for any
+ * sequence of characters.
+ */
+static bool
+pg_timeout_pattern_match(const char *pattern, const char *str)
+{
+	const char *star = NULL;
+	const char *retry = NULL;
+
+	while (*str != '\0')
+	{
+		if (*pattern == '*')
+		{
+			star = pattern++;
+			retry = str;
+		}
+		else if (*pattern == *str)
+		{
+			pattern++;
+			str++;
+		}
+		else if (star != NULL)
+		{
+			pattern = star + 1;
+			str = ++retry;
+		}
+		else
+			return false;
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == '\0';
+}
+
+/*
+ * First entry of pg_timeout.policies (or of the shadow policies) matching a
+ * session, NULL if none.
+ */
+static PgTimeoutRule *
+pg_timeout_match_rule(PgTimeoutRule *rules, int nrules, PgTimeoutCandidate *c)
+{
+	int			i;
+
+	for (i = 0; i < nrules; i++)
+	{
+		PgTimeoutRule *rule = &rules[i];
+
+		switch (rule->kind)
+		{
+			case RULE_DEFAULT:
+				return rule;
+			case RULE_ROLE:
+				if (rule->oid == c->roleid)
+					return rule;
+				break;
+			case RULE_DATABASE:
+				if (rule->oid == c->dbid)
+					return rule;
+				break;
+			case RULE_APPLICATION:
+				if (pg_timeout_pattern_match(rule->name, c->application_name))
+					return rule;
+				break;
+			case RULE_CIDR:
+				if (c->client_addr.addr.ss_family == rule->addr.ss_family &&
+					pg_range_sockaddr(&c->client_addr.addr, &rule->addr,
+									  &rule->mask))
+					return rule;
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Timeout of a session given the entry of pg_timeout.policies (or of the
+ * shadow policies) it matches, see pg_timeout_session_timeout().
+ */
+static int64
+pg_timeout_rule_timeout(PgTimeoutScan *scan, PgTimeoutCandidate *c,
+						PgTimeoutRule *rule)
+{
+	int			i;
+
+	for (i = 0; i < worker_policy.nschedules; i++)
+	{
+		PgTimeoutSchedule *schedule = &worker_policy.schedules[i];
+
+		if (scan->schedule_active[i] &&
+			(!OidIsValid(schedule->roleid) || schedule->roleid == c->roleid))
+			return schedule->timeout_ms;
+	}
+
+	if (rule != NULL && !rule->exempt)
+		return rule->timeout_ms;
+
+	return worker_policy.idle_session_timeout_ms;
+}
+
+/*
+ * Idle session timeout of a session at the time of the scan: the first
+ * active schedule entry for its role or for all roles, else the first
+ * matching entry of pg_timeout.policies, else
+ * pg_timeout.idle_session_timeout.  A session matching an exempt entry is
+ * flagged for pg_timeout_apply_exemptions(), whatever the schedules.
+ */
+static int64
+pg_timeout_session_timeout(PgTimeoutScan *scan, PgTimeoutCandidate *c)
+{
+	PgTimeoutRule *rule = pg_timeout_match_rule(worker_policy.rules,
+												worker_policy.nrules, c);
+
+	if (rule != NULL && rule->exempt)
+		c->exempt |= PG_TIMEOUT_EXEMPT_POLICY;
+
+	return pg_timeout_rule_timeout(scan, c, rule);
+}
+
+/*
+ * Send SIGTERM to a backend, like pg_terminate_backend() does.
+ */
+static bool
+pg_timeout_signal_backend(int pid)
+{
+	if (BackendPidGetProc(pid) == NULL)
+		return false;
+
+#ifdef HAVE_SETSID
+	if (kill(-pid, SIGTERM))
+#else
+	if (kill(pid, SIGTERM))
+#endif
+	{
+		ereport(WARNING,
+				(errmsg("could not send signal to process %d: %m", pid)));
+		return false;
+	}
+
+	return true;
+}
+
+static void
+pg_timeout_sketch_add(PgTimeoutSketch *sketch, double value)
+{
+	int			i = 0;
+
+	if (value >= 1.0)
+		i = Min(1 + (int) ceil(log(value) / log(SKETCH_GAMMA)), SKETCH_BUCKETS - 1);
+
+	sketch->counts[i]++;
+	sketch->total++;
+	sketch->max = Max(sketch->max, value);
+}
+
+static void
+pg_timeout_sketch_merge(PgTimeoutSketch *sketch, const PgTimeoutSketch *other)
+{
+	int			i;
+
+	for (i = 0; i < SKETCH_BUCKETS; i++)
+		sketch->counts[i] += other->counts[i];
+	sketch->total += other->total;
+	sketch->max = Max(sketch->max, other->max);
+}
+
+/*
+ * Estimate of the q-quantile, 0 <= q <= 1, of the values of a non-empty
+ * sketch: the middle of the bucket holding it, in relative terms.
+ */
+static double
+pg_timeout_sketch_quantile(const PgTimeoutSketch *sketch, double q)
+{
+	uint64		rank = (uint64) floor(q * (sketch->total - 1));
+	uint64		seen = 0;
+	int			i;
+
+	for (i = 0; i < SKETCH_BUCKETS - 1; i++)
+	{
+		seen += sketch->counts[i];
+		if (seen > rank)
+			break;
+	}
+
+	if (i == 0)
+		return 0.0;
+	return Min(2.0 * pow(SKETCH_GAMMA, i - 1) / (SKETCH_GAMMA + 1.0),
+			   sketch->max);
+}
+
+/*
+ * Follow a signalled session until its process slot is released.
+ */
+static void
+pg_timeout_track_termination(int pid, TimestampTz backend_start,
+							 TimestampTz signalled)
+{
+	PgTimeoutPending *pending;
+	bool		found;
+
+	if (worker_pending == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(int);
+		ctl.entrysize = sizeof(PgTimeoutPending);
+		worker_pending = hash_create("pg_timeout pending terminations", 64,
+									 &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	pending = hash_search(worker_pending, &pid, HASH_ENTER, &found);
+	if (!found)
+	{
+		pending->backend_start = backend_start;
+		pending->signalled = signalled;
+		pending->verified = signalled;
+		pending->stuck = false;
+		worker_pending_followed++;
+	}
+}
+
+/*
+ * Check whether the sessions signalled have released their process slot,
+ * i.e. have left the proc array and no longer count against
+ * max_connections, and record the time it took.  Sessions still there
+ * after pg_timeout.terminate_timeout are reported once: a backend blocked
+ * in an uninterruptible system call cannot be stopped harder without
+ * restarting the whole server.  They are then only checked at each
+ * naptime, instead of every VERIFY_INTERVAL_MS.
+ *
+ * Once a session is stuck, a process with its PID is compared by its start
+ * time with the one signalled, so that a PID reused by a new backend does
+ * not keep it followed forever.
+ */
+static void
+pg_timeout_verify_terminations(TimestampTz now)
+{
+	HASH_SEQ_STATUS status;
+	PgTimeoutPending *pending;
+	PgTimeoutSketch latency;
+	int64		follow_ms = worker_policy.terminate_timeout_ms > 0 ?
+		worker_policy.terminate_timeout_ms : VERIFY_FOLLOW_MS;
+	int			nchecked = 0;
+	int			nrecycled = 0;
+	int			nstuck = 0;
+	int			nfollowed = 0;
+	long		npending;
+
+	if (worker_pending == NULL || hash_get_num_entries(worker_pending) == 0)
+		return;
+
+	memset(&latency, 0, sizeof(latency));
+
+	hash_seq_init(&status, worker_pending);
+	while ((pending = hash_seq_search(&status)) != NULL)
+	{
+		int64		elapsed_ms = (now - pending->signalled) / 1000;
+
+		pending->checked = false;
+		if (BackendPidGetProc(pending->pid) == NULL)
+		{
+			pg_timeout_sketch_add(&latency, elapsed_ms);
+			hash_search(worker_pending, &pending->pid, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		if (elapsed_ms < follow_ms)
+		{
+			nfollowed++;
+			continue;
+		}
+
+		if (pending->stuck &&
+			now < TimestampTzPlusMilliseconds(pending->verified,
+											  worker_policy.naptime_ms))
+			continue;
+
+		pending->verified = now;
+		pending->checked = true;
+		pending->recycled = true;
+		nchecked++;
+	}
+
+	if (nchecked > 0)
+	{
+		int			nbackends = pgstat_fetch_stat_numbackends();
+		int			i;
+
+		for (i = 1; i <= nbackends; i++)
+		{
+			LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+			PgBackendStatus *be;
+
+			if (local == NULL)
+				continue;
+			be = &local->backendStatus;
+
+			pending = hash_search(worker_pending, &be->st_procpid, HASH_FIND,
+								  NULL);
+			if (pending != NULL && pending->checked &&
+				be->st_proc_start_timestamp == pending->backend_start)
+				pending->recycled = false;
+		}
+		pgstat_clear_snapshot();
+
+		hash_seq_init(&status, worker_pending);
+		while ((pending = hash_seq_search(&status)) != NULL)
+		{
+			PGPROC	   *proc;
+			int64		elapsed_ms = (now - pending->signalled) / 1000;
+
+			if (!pending->checked)
+				continue;
+
+			if (pending->recycled)
+			{
+				nrecycled++;
+				hash_search(worker_pending, &pending->pid, HASH_REMOVE, NULL);
+				continue;
+			}
+
+			if (pending->stuck)
+				continue;
+
+			proc = BackendPidGetProc(pending->pid);
+			if (proc != NULL && worker_policy.terminate_timeout_ms > 0)
+			{
+				uint32		wait_event_info = UINT32_ACCESS_ONCE(proc->wait_event_info);
+				const char *wait_event = pgstat_get_wait_event(wait_event_info);
+
+				ereport(WARNING,
+						(errmsg("%s: process %d has not exited %.3f s after being terminated",
+								MyBgworkerEntry->bgw_name, pending->pid,
+								elapsed_ms / 1000.0),
+						 wait_event ?
+						 errdetail("It is waiting on %s event %s.",
+								   pgstat_get_wait_event_type(wait_event_info),
+								   wait_event) : 0));
+				nstuck++;
+			}
+			pending->stuck = true;
+		}
+	}
+
+	worker_pending_followed = nfollowed;
+	npending = hash_get_num_entries(worker_pending);
+
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	pgts->reclaimed += latency.total + nrecycled;
+	pgts->stuck += nstuck;
+	pgts->pending_terminations = (int) npending;
+	pg_timeout_sketch_merge(&pgts->reclaim_latency, &latency);
+	LWLockRelease(&pgts->lock);
+}
+
+/*
+ * Order candidates by decreasing priority.
+ */
+static int
+pg_timeout_candidate_cmp(const void *a, const void *b)
+{
+	const PgTimeoutCandidate *ca = (const PgTimeoutCandidate *) a;
+	const PgTimeoutCandidate *cb = (const PgTimeoutCandidate *) b;
+
+	if (ca->priority > cb->priority)
+		return -1;
+	if (ca->priority < cb->priority)
+		return 1;
+	return 0;
+}
+
+/*
+ * Start the transaction of a check the first time it is needed: only
+ * catalog lookups, the policy function and notifications need one, so a
+ * check which finds nothing to do stays cheap.
+ *
+ * Note that each StartTransactionCommand() call should be preceded by a
+ * SetCurrentStatementStartTimestamp() call, which sets both the time for
+ * the statement we're about the run, and also the transaction start time.
+ * The pgstat_report_activity() call makes our activity visible through the
+ * pgstat views.
+ */
+static void
+pg_timeout_begin_xact(PgTimeoutScan *scan)
+{
+	if (scan->in_xact)
+		return;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, "pg_timeout check");
+	scan->in_xact = true;
+}
+
+static PgTimeoutGroup *
+pg_timeout_lookup_group(Oid roleid, Oid dbid, const char *application_name)
+{
+	PgTimeoutGroupKey key;
+	PgTimeoutGroup *group;
+	bool		found;
+
+	if (worker_groups == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(PgTimeoutGroupKey);
+		ctl.entrysize = sizeof(PgTimeoutGroup);
+		worker_groups = hash_create("pg_timeout client groups", 64, &ctl,
+									HASH_ELEM | HASH_BLOBS);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.roleid = roleid;
+	key.dbid = dbid;
+	strlcpy(key.application_name, application_name, NAMEDATALEN);
+
+	group = hash_search(worker_groups, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		group->new_connections = 0;
+		group->reconnect_rate = 0.0;
+	}
+
+	return group;
+}
+
+/*
+ * Fold the connections counted during the scan into the reconnect rate of
+ * each group, and forget the groups not seen for a while.
+ */
+static void
+pg_timeout_update_groups(TimestampTz now)
+{
+	HASH_SEQ_STATUS status;
+	PgTimeoutGroup *group;
+	double		elapsed;
+
+	if (worker_groups == NULL)
+		return;
+
+	elapsed = worker_last_scan == 0 ? 0.0 :
+		(double) (now - worker_last_scan) / USECS_PER_SEC;
+
+	hash_seq_init(&status, worker_groups);
+	while ((group = hash_seq_search(&status)) != NULL)
+	{
+		if (elapsed > 0.0)
+		{
+			double		alpha = 1.0 - exp(-elapsed / RECONNECT_RATE_WINDOW);
+			double		rate = group->new_connections * 60.0 / elapsed;
+
+			group->reconnect_rate += alpha * (rate - group->reconnect_rate);
+		}
+		group->new_connections = 0;
+
+		if (now - group->last_seen > RECONNECT_RATE_WINDOW * 12 * USECS_PER_SEC)
+			hash_search(worker_groups, &group->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Time accounting entry of a client group.  A group new to the worker gets
+ * the shared entry with the same key, which a previous worker may have
+ * created, else the next free one if any left.
+ */
+static PgTimeoutAccountEntry *
+pg_timeout_lookup_account(Oid roleid, Oid dbid, const char *application_name)
+{
+	PgTimeoutGroupKey key;
+	PgTimeoutAccountEntry *account;
+	bool		found;
+
+	if (worker_accounts == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(PgTimeoutGroupKey);
+		ctl.entrysize = sizeof(PgTimeoutAccountEntry);
+		worker_accounts = hash_create("pg_timeout accounts", 64, &ctl,
+									  HASH_ELEM | HASH_BLOBS);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.roleid = roleid;
+	key.dbid = dbid;
+	strlcpy(key.application_name, application_name, NAMEDATALEN);
+
+	account = hash_search(worker_accounts, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		PgTimeoutAccount *accounts = pg_timeout_accounts(pgts);
+		int			i;
+
+		LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+		account->slot = -1;
+		for (i = 0; i < pgts->naccounts; i++)
+		{
+			if (memcmp(&accounts[i].key, &key, sizeof(key)) == 0)
+			{
+				account->slot = i;
+				break;
+			}
+		}
+		if (account->slot < 0 && pgts->naccounts < pgts->max_accounts)
+		{
+			account->slot = pgts->naccounts++;
+			memset(&accounts[account->slot], 0, sizeof(PgTimeoutAccount));
+			memcpy(&accounts[account->slot].key, &key, sizeof(key));
+		}
+		LWLockRelease(&pgts->lock);
+
+		memset(&account->pending, 0, sizeof(PgTimeoutStateTimes));
+		memset(&account->pending_gaps, 0, sizeof(PgTimeoutSketch));
+		account->active = 0;
+		account->seen = 0;
+	}
+
+	return account;
+}
+
+static void
+pg_timeout_account_time(PgTimeoutStateTimes *times, BackendState state,
+						int64 usecs)
+{
+	if (usecs <= 0)
+		return;
+
+	switch (state)
+	{
+		case STATE_RUNNING:
+		case STATE_FASTPATH:
+			times->active_time += usecs;
+			break;
+		case STATE_IDLE:
+			times->idle_time += usecs;
+			break;
+		case STATE_IDLEINTRANSACTION:
+		case STATE_IDLEINTRANSACTION_ABORTED:
+			times->idle_in_xact_time += usecs;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Account the time spent by a client backend since it was last seen.
+ *
+ * Only the state at each scan and the start of the current state are known:
+ * the time until the state changed goes to the state seen at the previous
+ * scan, the states the backend went through in between are missed.
+ */
+static void
+pg_timeout_account_backend(TimestampTz now, PgBackendStatus *be)
+{
+	PgTimeoutAccountEntry *account;
+	PgTimeoutBackend *backend;
+	TimestampTz since;
+	bool		found;
+
+	if (worker_backends == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(int);
+		ctl.entrysize = sizeof(PgTimeoutBackend);
+		worker_backends = hash_create("pg_timeout backends", 256, &ctl,
+									  HASH_ELEM | HASH_BLOBS);
+	}
+
+	account = pg_timeout_lookup_account(be->st_userid, be->st_databaseid,
+										be->st_appname ? be->st_appname : "");
+	backend = hash_search(worker_backends, &be->st_procpid, HASH_ENTER, &found);
+
+	if (!found || backend->backend_start != be->st_proc_start_timestamp)
+	{
+		/* time before the worker started is not accounted */
+		backend->backend_start = be->st_proc_start_timestamp;
+		account->pending.sessions++;
+		since = worker_last_scan == 0 ? now :
+			Max(be->st_state_start_timestamp, worker_last_scan);
+	}
+	else
+	{
+		since = backend->seen;
+		if (be->st_state_start_timestamp > since)
+		{
+			pg_timeout_account_time(&account->pending, backend->state,
+									be->st_state_start_timestamp - since);
+			since = be->st_state_start_timestamp;
+
+			/* the session was used again after an idle period */
+			if (backend->state == STATE_IDLE && be->st_state != STATE_IDLE)
+				pg_timeout_sketch_add(&account->pending_gaps,
+									  (be->st_state_start_timestamp -
+									   backend->state_start) / 1000.0);
+		}
+	}
+
+	pg_timeout_account_time(&account->pending, be->st_state, now - since);
+	backend->state = be->st_state;
+	backend->state_start = be->st_state_start_timestamp;
+	backend->seen = now;
+
+	/* a session in a transaction holds its pooled connection */
+	if (account->seen != now)
+	{
+		account->active = 0;
+		account->seen = now;
+	}
+	if (be->st_state == STATE_RUNNING ||
+		be->st_state == STATE_FASTPATH ||
+		be->st_state == STATE_IDLEINTRANSACTION ||
+		be->st_state == STATE_IDLEINTRANSACTION_ABORTED)
+		account->active++;
+}
+
+/*
+ * Add the times accounted during the scan to the shared entries, and forget
+ * the backends which have exited and the groups not seen for
+ * ACCOUNT_FORGET_MS, at once for the ones without a shared entry, so that
+ * client groups with changing names do not accumulate.
+ */
+static void
+pg_timeout_flush_accounts(TimestampTz now)
+{
+	HASH_SEQ_STATUS status;
+	PgTimeoutAccountEntry *account;
+	PgTimeoutBackend *backend;
+	PgTimeoutAccount *accounts = pg_timeout_accounts(pgts);
+
+	if (worker_accounts == NULL)
+		return;
+
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, worker_accounts);
+	while ((account = hash_seq_search(&status)) != NULL)
+	{
+		PgTimeoutAccount *shared;
+
+		/* groups past max_accounts have nothing to keep */
+		if (account->slot < 0)
+		{
+			if (account->seen != now)
+				hash_search(worker_accounts, &account->key, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		shared = &accounts[account->slot];
+		shared->times.sessions += account->pending.sessions;
+		shared->times.active_time += account->pending.active_time;
+		shared->times.idle_time += account->pending.idle_time;
+		shared->times.idle_in_xact_time += account->pending.idle_in_xact_time;
+		memset(&account->pending, 0, sizeof(PgTimeoutStateTimes));
+
+		pg_timeout_sketch_merge(&shared->idle_gaps, &account->pending_gaps);
+		memset(&account->pending_gaps, 0, sizeof(PgTimeoutSketch));
+
+		/* groups without any session are not counted */
+		if (account->seen == now)
+			pg_timeout_sketch_add(&shared->active, account->active);
+		else if (now - account->seen > ACCOUNT_FORGET_MS * (int64) 1000)
+			hash_search(worker_accounts, &account->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(&pgts->lock);
+
+	hash_seq_init(&status, worker_backends);
+	while ((backend = hash_seq_search(&status)) != NULL)
+	{
+		if (backend->seen != now)
+			hash_search(worker_backends, &backend->pid, HASH_REMOVE, NULL);
+	}
+}
+
+static PgTimeoutIdleCount *
+pg_timeout_idle_count(PgTimeoutScan *scan, Oid roleid, Oid dbid)
+{
+	PgTimeoutIdleCountKey key;
+	PgTimeoutIdleCount *entry;
+	bool		found;
+
+	key.roleid = roleid;
+	key.dbid = dbid;
+	entry = hash_search(scan->idle_counts, &key, HASH_ENTER, &found);
+	if (!found)
+		entry->count = 0;
+
+	return entry;
+}
+
+/*
+ * Whether the last statement of a session was LISTEN.  The listening
+ * backends are private to async.c, so this is what says cheaply that an
+ * idle session is waiting for notifications.
+ */
+static bool
+pg_timeout_is_listen(const char *query)
+{
+	if (query == NULL)
+		return false;
+	while (isspace((unsigned char) *query))
+		query++;
+	return pg_strncasecmp(query, "listen", 6) == 0 &&
+		isspace((unsigned char) query[6]);
+}
+
+/*
+ * Add a backend to the batch, with the fields of PgTimeoutCandidate that
+ * come from its status entry, the time since its last state change
+ * included.  The caller decides the rest.
+ */
+static PgTimeoutCandidate *
+pg_timeout_fill_candidate(PgTimeoutScan *scan, PgBackendStatus *be)
+{
+	PgTimeoutCandidate *c = &scan->candidates[scan->ncandidates++];
+
+	memset(c, 0, sizeof(PgTimeoutCandidate));
+	c->pid = be->st_procpid;
+	c->roleid = be->st_userid;
+	c->dbid = be->st_databaseid;
+	c->state = be->st_state;
+	c->state_change = be->st_state_start_timestamp;
+	c->backend_start = be->st_proc_start_timestamp;
+	c->xact_start = be->st_xact_start_timestamp;
+	c->client_addr = be->st_clientaddr;
+	if (be->st_appname)
+		strlcpy(c->application_name, be->st_appname, NAMEDATALEN);
+	if (be->st_clienthostname)
+		strlcpy(c->client_hostname, be->st_clienthostname, NAMEDATALEN);
+	c->idle_ms = (scan->now - c->state_change) / 1000;
+
+	return c;
+}
+
+/*
+ * Build the batch of candidates from the local copy of the backend status
+ * array, in a single pass and without going through pg_stat_activity.
+ *
+ * Only client backends in idle state are returned as candidates, but all
+ * client backends are counted.
+ */
+static void
+pg_timeout_collect(PgTimeoutScan *scan)
+{
+	int			nbackends = pgstat_fetch_stat_numbackends();
+	int			i;
+
+	scan->candidates = palloc0(sizeof(PgTimeoutCandidate) * Max(nbackends, 1));
+	scan->ncandidates = 0;
+	scan->nclients = 0;
+	scan->idle_counts = NULL;
+	pg_timeout_resolve_schedules(scan);
+
+	if (worker_policy.max_idle_per_role > 0 ||
+		worker_policy.max_idle_per_database > 0)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(PgTimeoutIdleCountKey);
+		ctl.entrysize = sizeof(PgTimeoutIdleCount);
+		ctl.hcxt = CurrentMemoryContext;
+		scan->idle_counts = hash_create("pg_timeout idle counts", 64, &ctl,
+										HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+		PgTimeoutCandidate *c;
+		PgTimeoutGroup *group;
+
+		if (local == NULL)
+			continue;
+		be = &local->backendStatus;
+
+		if (be->st_backendType != B_BACKEND ||
+			be->st_procpid <= 0 ||
+			be->st_procpid == MyProcPid)
+			continue;
+
+		scan->nclients++;
+
+		group = pg_timeout_lookup_group(be->st_userid, be->st_databaseid,
+										be->st_appname ? be->st_appname : "");
+		group->last_seen = scan->now;
+		if (worker_last_scan != 0 &&
+			be->st_proc_start_timestamp > worker_last_scan)
+			group->new_connections++;
+
+		if (pgts->max_accounts > 0)
+			pg_timeout_account_backend(scan->now, be);
+
+		if (be->st_state != STATE_IDLE)
+			continue;
+
+		c = pg_timeout_fill_candidate(scan, be);
+		c->reconnect_rate = group->reconnect_rate;
+		c->priority = c->idle_ms / 1000.0;
+		c->timeout_ms = pg_timeout_session_timeout(scan, c);
+		if ((worker_policy.exemptions & PG_TIMEOUT_EXEMPT_LISTEN) &&
+			pg_timeout_is_listen(be->st_activity_raw))
+			c->exempt |= PG_TIMEOUT_EXEMPT_LISTEN;
+		c->terminate = (c->idle_ms >= c->timeout_ms);
+		if (c->terminate)
+			snprintf(c->reason, sizeof(c->reason),
+					 "idle_session_timeout=%.3fs", c->timeout_ms / 1000.0);
+
+		if (scan->idle_counts != NULL)
+		{
+			pg_timeout_idle_count(scan, c->roleid, InvalidOid)->count++;
+			pg_timeout_idle_count(scan, InvalidOid, c->dbid)->count++;
+		}
+	}
+
+	pg_timeout_update_groups(scan->now);
+	pg_timeout_flush_accounts(scan->now);
+	worker_last_scan = scan->now;
+}
+
+static int
+pg_timeout_pid_cmp(const void *a, const void *b)
+{
+	int32		pa = *(const int32 *) a;
+	int32		pb = *(const int32 *) b;
+
+	if (pa < pb)
+		return -1;
+	if (pa > pb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Find the idle sessions exempted by pg_timeout.exemptions, and either keep
+ * them, with a timeout of -1, or apply pg_timeout.exempt_idle_session_timeout
+ * to them.  They stay in the batch, flagged, for the shadow policies and the
+ * hooks; the other decisions skip them.  LISTEN was seen by pg_timeout_collect(); advisory lock holders
+ * come from a single copy of the lock table, and temporary table users from
+ * the temporary namespace of each process.  Exempted sessions do not count
+ * against the idle session quotas.
+ */
+static void
+pg_timeout_apply_exemptions(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	int32	   *lockers = NULL;
+	int32	   *temp_users = NULL;
+	int			nlockers = 0;
+	int			ntemp_users = 0;
+	int			i;
+
+	if ((policy->exemptions == 0 && policy->nrules == 0) ||
+		scan->ncandidates == 0)
+		return;
+
+	if (policy->exemptions & PG_TIMEOUT_EXEMPT_ADVISORY_LOCK)
+	{
+		LockData   *lockdata = GetLockStatusData();
+
+		lockers = palloc(sizeof(int32) * Max(lockdata->nelements, 1));
+		for (i = 0; i < lockdata->nelements; i++)
+		{
+			LockInstanceData *instance = &lockdata->locks[i];
+
+			if (instance->locktag.locktag_type == LOCKTAG_ADVISORY &&
+				instance->holdMask != 0)
+				lockers[nlockers++] = instance->pid;
+		}
+		qsort(lockers, nlockers, sizeof(int32), pg_timeout_pid_cmp);
+	}
+
+	if (policy->exemptions & PG_TIMEOUT_EXEMPT_TEMP_TABLE)
+	{
+		temp_users = palloc(sizeof(int32) * Max(ProcGlobal->allProcCount, 1));
+		for (i = 0; i < ProcGlobal->allProcCount; i++)
+		{
+			PGPROC	   *proc = &ProcGlobal->allProcs[i];
+
+			if (proc->pid != 0 && OidIsValid(proc->tempNamespaceId))
+				temp_users[ntemp_users++] = proc->pid;
+		}
+		qsort(temp_users, ntemp_users, sizeof(int32), pg_timeout_pid_cmp);
+	}
+
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+
+		if (nlockers > 0 &&
+			bsearch(&c->pid, lockers, nlockers, sizeof(int32),
+					pg_timeout_pid_cmp) != NULL)
+			c->exempt |= PG_TIMEOUT_EXEMPT_ADVISORY_LOCK;
+		if (ntemp_users > 0 &&
+			bsearch(&c->pid, temp_users, ntemp_users, sizeof(int32),
+					pg_timeout_pid_cmp) != NULL)
+			c->exempt |= PG_TIMEOUT_EXEMPT_TEMP_TABLE;
+
+		if (c->exempt != 0)
+		{
+			if (scan->idle_counts != NULL)
+			{
+				pg_timeout_idle_count(scan, c->roleid, InvalidOid)->count--;
+				pg_timeout_idle_count(scan, InvalidOid, c->dbid)->count--;
+			}
+
+			c->timeout_ms = policy->exempt_timeout_ms > 0 ?
+				policy->exempt_timeout_ms : -1;
+			c->terminate = (c->timeout_ms >= 0 && c->idle_ms >= c->timeout_ms);
+			if (c->terminate)
+				snprintf(c->reason, sizeof(c->reason),
+						 "exempt_idle_session_timeout=%.3fs",
+						 c->timeout_ms / 1000.0);
+			else
+				c->reason[0] = '\0';
+		}
+	}
+}
+
+static int
+pg_timeout_idle_cmp(const void *a, const void *b)
+{
+	const PgTimeoutCandidate *ca = *(PgTimeoutCandidate *const *) a;
+	const PgTimeoutCandidate *cb = *(PgTimeoutCandidate *const *) b;
+
+	if (ca->idle_ms > cb->idle_ms)
+		return -1;
+	if (ca->idle_ms < cb->idle_ms)
+		return 1;
+	return 0;
+}
+
+/*
+ * Terminate the longest idle sessions of the roles and databases holding
+ * more than pg_timeout.max_idle_per_role or max_idle_per_database idle
+ * sessions, using the counts of the scan.
+ */
+static void
+pg_timeout_enforce_quotas(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	PgTimeoutCandidate **sorted;
+	int			nsorted = 0;
+	int			i;
+
+	if (scan->idle_counts == NULL || scan->ncandidates == 0)
+		return;
+
+	/* sessions already selected do not count against the quotas */
+	sorted = palloc(sizeof(PgTimeoutCandidate *) * scan->ncandidates);
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+
+		if (c->exempt != 0)
+			continue;
+
+		if (c->terminate)
+		{
+			pg_timeout_idle_count(scan, c->roleid, InvalidOid)->count--;
+			pg_timeout_idle_count(scan, InvalidOid, c->dbid)->count--;
+		}
+		else
+			sorted[nsorted++] = c;
+	}
+
+	qsort(sorted, nsorted, sizeof(PgTimeoutCandidate *), pg_timeout_idle_cmp);
+
+	for (i = 0; i < nsorted; i++)
+	{
+		PgTimeoutCandidate *c = sorted[i];
+		PgTimeoutIdleCount *role_count = pg_timeout_idle_count(scan, c->roleid, InvalidOid);
+		PgTimeoutIdleCount *db_count = pg_timeout_idle_count(scan, InvalidOid, c->dbid);
+
+		if (policy->max_idle_per_role > 0 &&
+			role_count->count > policy->max_idle_per_role)
+			snprintf(c->reason, sizeof(c->reason), "max_idle_per_role=%d",
+					 policy->max_idle_per_role);
+		else if (policy->max_idle_per_database > 0 &&
+				 db_count->count > policy->max_idle_per_database)
+			snprintf(c->reason, sizeof(c->reason), "max_idle_per_database=%d",
+					 policy->max_idle_per_database);
+		else
+			continue;
+
+		c->terminate = true;
+		role_count->count--;
+		db_count->count--;
+	}
+
+	pfree(sorted);
+}
+
+/*
+ * Anonymous resident memory of a backend in kB, i.e. what is given back to
+ * the system when it exits.  Only available on Linux.
+ */
+static int64
+pg_timeout_backend_memory(int pid)
+{
+#ifdef __linux__
+	char		path[MAXPGPATH];
+	char		line[256];
+	FILE	   *file;
+	int64		kb = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	file = AllocateFile(path, "r");
+	if (file == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (strncmp(line, "RssAnon:", 8) == 0)
+		{
+			kb = strtoi64(line + 8, NULL, 10);
+			break;
+		}
+	}
+	FreeFile(file);
+
+	return kb;
+#else
+	return 0;
+#endif
+}
+
+static int
+pg_timeout_score_cmp(const void *a, const void *b)
+{
+	const PgTimeoutCandidate *ca = *(PgTimeoutCandidate *const *) a;
+	const PgTimeoutCandidate *cb = *(PgTimeoutCandidate *const *) b;
+
+	if (ca->score > cb->score)
+		return -1;
+	if (ca->score < cb->score)
+		return 1;
+	return 0;
+}
+
+/*
+ * Tenant of the fair-share selection: the idle sessions of a role in a
+ * database, and the ones selected so far, in a min-heap on their score
+ * holding at most quota sessions.
+ */
+typedef struct PgTimeoutTenant
+{
+	PgTimeoutIdleCountKey key;
+	int			nidle;
+	int			neligible;
+	double		share;			/* nidle / priority */
+	int			quota;
+	double		remainder;
+	int			nvictims;
+	PgTimeoutCandidate **victims;
+} PgTimeoutTenant;
+
+static double
+pg_timeout_tenant_priority(Oid roleid, Oid dbid)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	double		priority = 1.0;
+	int			i;
+
+	for (i = 0; i < policy->ntenant_priorities; i++)
+	{
+		PgTimeoutTenantPriority *tenant = &policy->tenant_priorities[i];
+
+		if (tenant->oid == (tenant->is_role ? roleid : dbid))
+			priority *= tenant->priority;
+	}
+
+	return priority;
+}
+
+static void
+pg_timeout_victim_push(PgTimeoutTenant *tenant, PgTimeoutCandidate *c)
+{
+	PgTimeoutCandidate **heap = tenant->victims;
+	int			i;
+
+	if (tenant->nvictims < tenant->quota)
+	{
+		/* sift up */
+		i = tenant->nvictims++;
+		while (i > 0 && heap[(i - 1) / 2]->score > c->score)
+		{
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = c;
+		return;
+	}
+
+	if (tenant->quota == 0 || c->score <= heap[0]->score)
+		return;
+
+	/* replace the lowest score, and sift down */
+	i = 0;
+	for (;;)
+	{
+		int			child = 2 * i + 1;
+
+		if (child >= tenant->nvictims)
+			break;
+		if (child + 1 < tenant->nvictims &&
+			heap[child + 1]->score < heap[child]->score)
+			child++;
+		if (heap[child]->score >= c->score)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = c;
+}
+
+static int
+pg_timeout_remainder_cmp(const void *a, const void *b)
+{
+	const PgTimeoutTenant *ta = *(PgTimeoutTenant *const *) a;
+	const PgTimeoutTenant *tb = *(PgTimeoutTenant *const *) b;
+
+	if (ta->remainder > tb->remainder)
+		return -1;
+	if (ta->remainder < tb->remainder)
+		return 1;
+	return 0;
+}
+
+/*
+ * Select excess sessions among the eligible ones, spreading them over the
+ * tenants in proportion to their number of idle sessions divided by their
+ * priority, so that a single tenant does not lose its whole pool.  Tenants
+ * with fewer eligible sessions than their share give the rest to the
+ * others.  Within a tenant the best scores are selected.
+ *
+ * Candidates are read twice, to count and to select, and each one costs a
+ * hash lookup and a push into the bounded heap of its tenant: there is no
+ * sort of the whole batch.
+ */
+static void
+pg_timeout_select_fair_share(PgTimeoutScan *scan, PgTimeoutCandidate **eligible,
+							 int neligible, int excess)
+{
+	HTAB	   *tenants;
+	HASHCTL		ctl;
+	HASH_SEQ_STATUS status;
+	PgTimeoutTenant *tenant;
+	PgTimeoutTenant **open;
+	int			ntenants;
+	int			nopen;
+	int			remaining = Min(excess, neligible);
+	int			i;
+
+	ctl.keysize = sizeof(PgTimeoutIdleCountKey);
+	ctl.entrysize = sizeof(PgTimeoutTenant);
+	ctl.hcxt = CurrentMemoryContext;
+	tenants = hash_create("pg_timeout tenants", 64, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* idle sessions still there after the timeouts give the shares */
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+		PgTimeoutIdleCountKey key;
+		bool		found;
+
+		if (c->terminate || c->exempt != 0)
+			continue;
+
+		key.roleid = c->roleid;
+		key.dbid = c->dbid;
+		tenant = hash_search(tenants, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			memset((char *) tenant + sizeof(key), 0,
+				   sizeof(PgTimeoutTenant) - sizeof(key));
+			tenant->share = 1.0 / pg_timeout_tenant_priority(c->roleid, c->dbid);
+		}
+		tenant->nidle++;
+	}
+
+	for (i = 0; i < neligible; i++)
+	{
+		PgTimeoutIdleCountKey key;
+
+		key.roleid = eligible[i]->roleid;
+		key.dbid = eligible[i]->dbid;
+		tenant = hash_search(tenants, &key, HASH_FIND, NULL);
+		tenant->neligible++;
+	}
+
+	ntenants = hash_get_num_entries(tenants);
+	open = palloc(sizeof(PgTimeoutTenant *) * Max(ntenants, 1));
+	nopen = 0;
+	hash_seq_init(&status, tenants);
+	while ((tenant = hash_seq_search(&status)) != NULL)
+	{
+		tenant->share *= tenant->nidle;
+		if (tenant->neligible > 0)
+			open[nopen++] = tenant;
+	}
+
+	/*
+	 * Tenants whose share is over their eligible sessions give all of them,
+	 * which can only raise the share of the others: repeat until none is.
+	 */
+	for (;;)
+	{
+		double		total = 0.0;
+		double		ratio;
+		int			n = 0;
+		bool		capped = false;
+
+		for (i = 0; i < nopen; i++)
+			total += open[i]->share;
+		ratio = total > 0.0 ? remaining / total : 0.0;
+
+		for (i = 0; i < nopen; i++)
+		{
+			tenant = open[i];
+			if (ratio * tenant->share >= tenant->neligible)
+			{
+				tenant->quota = tenant->neligible;
+				remaining -= tenant->quota;
+				capped = true;
+			}
+			else
+				open[n++] = tenant;
+		}
+		nopen = n;
+
+		if (!capped)
+		{
+			int			assigned = 0;
+
+			for (i = 0; i < nopen; i++)
+			{
+				double		exact = ratio * open[i]->share;
+
+				open[i]->quota = (int) floor(exact);
+				open[i]->remainder = exact - open[i]->quota;
+				assigned += open[i]->quota;
+			}
+
+			/* largest remainders get the sessions left */
+			qsort(open, nopen, sizeof(PgTimeoutTenant *), pg_timeout_remainder_cmp);
+			for (i = 0; i < nopen && assigned < remaining; i++, assigned++)
+				open[i]->quota++;
+			break;
+		}
+	}
+
+	for (i = 0; i < neligible; i++)
+	{
+		PgTimeoutIdleCountKey key;
+
+		key.roleid = eligible[i]->roleid;
+		key.dbid = eligible[i]->dbid;
+		tenant = hash_search(tenants, &key, HASH_FIND, NULL);
+		if (tenant->quota == 0)
+			continue;
+		if (tenant->victims == NULL)
+			tenant->victims = palloc(sizeof(PgTimeoutCandidate *) * tenant->quota);
+		pg_timeout_victim_push(tenant, eligible[i]);
+	}
+
+	hash_seq_init(&status, tenants);
+	while ((tenant = hash_seq_search(&status)) != NULL)
+	{
+		for (i = 0; i < tenant->nvictims; i++)
+		{
+			PgTimeoutCandidate *c = tenant->victims[i];
+
+			c->terminate = true;
+			c->priority = c->score;
+			snprintf(c->reason, sizeof(c->reason),
+					 "connection_pressure fair_share score=%.2f", c->score);
+		}
+	}
+
+	hash_destroy(tenants);
+}
+
+/*
+ * When client backends exceed pg_timeout.pressure_threshold percent of
+ * max_connections, select additional idle sessions until enough slots are
+ * freed, best score first or with pg_timeout_select_fair_share().
+ *
+ * The score is what the eviction frees (idle time and memory) divided by
+ * what it costs the client to reconnect (a warm session is assumed to be
+ * worth more the older it is, and a group reconnecting often pays the
+ * connection cost again and again):
+ *
+ *    idle_weight * idle minutes + memory_weight * memory MB
+ *    ------------------------------------------------------------------
+ *    1 + age_weight * session hours + reconnect_weight * reconnects/min
+ */
+static void
+pg_timeout_evict_under_pressure(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	PgTimeoutCandidate **eligible;
+	int			neligible = 0;
+	int			limit;
+	int			excess;
+	int			i;
+
+	if (policy->pressure_threshold == 0)
+		return;
+
+	limit = (int) ((int64) MaxConnections * policy->pressure_threshold / 100);
+	excess = scan->nclients - limit;
+	for (i = 0; i < scan->ncandidates; i++)
+		if (scan->candidates[i].terminate)
+			excess--;
+	if (excess <= 0)
+		return;
+
+	eligible = palloc(sizeof(PgTimeoutCandidate *) * scan->ncandidates);
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+		double		benefit;
+		double		cost;
+
+		if (c->terminate || c->exempt != 0 ||
+			c->idle_ms < policy->pressure_min_idle_ms)
+			continue;
+
+		if (policy->score_memory_weight > 0.0)
+			c->memory_kb = pg_timeout_backend_memory(c->pid);
+
+		benefit = policy->score_idle_weight * c->idle_ms / 60000.0 +
+			policy->score_memory_weight * c->memory_kb / 1024.0;
+		cost = 1.0 +
+			policy->score_age_weight *
+			(double) (scan->now - c->backend_start) / USECS_PER_HOUR +
+			policy->score_reconnect_weight * c->reconnect_rate;
+		c->score = benefit / cost;
+
+		eligible[neligible++] = c;
+	}
+
+	if (policy->pressure_selection == PRESSURE_SELECTION_FAIR_SHARE)
+	{
+		pg_timeout_select_fair_share(scan, eligible, neligible, excess);
+		pfree(eligible);
+		return;
+	}
+
+	qsort(eligible, neligible, sizeof(PgTimeoutCandidate *),
+		  pg_timeout_score_cmp);
+
+	for (i = 0; i < neligible && i < excess; i++)
+	{
+		PgTimeoutCandidate *c = eligible[i];
+
+		c->terminate = true;
+		c->priority = c->score;
+		snprintf(c->reason, sizeof(c->reason),
+				 "connection_pressure score=%.2f", c->score);
+	}
+
+	pfree(eligible);
+}
+
+/*
+ * The coordination between clusters uses flock() and mmap(), not available
+ * on Windows.
+ */
+static bool
+pg_timeout_check_host_segment(char **newval, void **extra, GucSource source)
+{
+#ifdef WIN32
+	if ((*newval)[0] != '\0')
+	{
+		GUC_check_errdetail("pg_timeout.host_segment is not supported on Windows.");
+		return false;
+	}
+#endif
+	return true;
+}
+
+#ifndef WIN32
+
+/*
+ * Memory of the host in kB, total and available to new allocations without
+ * swapping.  Only available on Linux, returns false elsewhere.
+ */
+static bool
+pg_timeout_host_memory(int64 *total_kb, int64 *available_kb)
+{
+#ifdef __linux__
+	char		line[256];
+	FILE	   *file;
+
+	*total_kb = *available_kb = -1;
+
+	file = AllocateFile("/proc/meminfo", "r");
+	if (file == NULL)
+		return false;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (strncmp(line, "MemTotal:", 9) == 0)
+			*total_kb = strtoi64(line + 9, NULL, 10);
+		else if (strncmp(line, "MemAvailable:", 13) == 0)
+			*available_kb = strtoi64(line + 13, NULL, 10);
+	}
+	FreeFile(file);
+
+	return *total_kb > 0 && *available_kb >= 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Unmap and close the file of pg_timeout.host_segment, if any, freeing the
+ * entry of this cluster first so that the other clusters stop counting on
+ * it.  Closing the file also releases its lock.
+ */
+static void
+pg_timeout_unmap_host_segment(void)
+{
+	if (worker_host != NULL &&
+		worker_host->magic == HOST_SEGMENT_MAGIC &&
+		worker_host->version == HOST_SEGMENT_VERSION &&
+		flock(worker_host_fd, LOCK_EX) == 0)
+	{
+		int			i;
+
+		for (i = 0; i < MAX_HOST_CLUSTERS; i++)
+			if (worker_host->slots[i].postmaster_pid == PostmasterPid)
+				memset(&worker_host->slots[i], 0, sizeof(PgTimeoutHostSlot));
+		flock(worker_host_fd, LOCK_UN);
+	}
+
+	if (worker_host != NULL)
+		munmap(worker_host, sizeof(PgTimeoutHostSegment));
+	if (worker_host_fd >= 0)
+		close(worker_host_fd);
+	worker_host = NULL;
+	worker_host_fd = -1;
+}
+
+/*
+ * Map the file of pg_timeout.host_segment, creating it if needed.  The
+ * mapping is kept until the parameter changes; a file which cannot be
+ * mapped is reported once, and not tried again until then.
+ *
+ * Only a new or empty file is initialized: a file of another size or
+ * content is left alone.  A file created here gets the mode of the files of
+ * the data directory, so it must be created beforehand, writable by the
+ * operating system users of all clusters, when they run under different
+ * users.
+ */
+static PgTimeoutHostSegment *
+pg_timeout_map_host_segment(const char *path)
+{
+	void	   *addr;
+	struct stat st;
+	bool		fresh;
+
+	if (strcmp(path, worker_host_path) == 0)
+		return worker_host;
+
+	pg_timeout_unmap_host_segment();
+	strlcpy(worker_host_path, path, sizeof(worker_host_path));
+
+	if (path[0] == '\0')
+		return NULL;
+
+	worker_host_fd = BasicOpenFile(path, O_RDWR | O_CREAT | PG_BINARY);
+	if (worker_host_fd < 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not open pg_timeout.host_segment \"%s\": %m",
+						path)));
+		return NULL;
+	}
+
+	if (flock(worker_host_fd, LOCK_EX) != 0 ||
+		fstat(worker_host_fd, &st) != 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not lock pg_timeout.host_segment \"%s\": %m",
+						path)));
+		pg_timeout_unmap_host_segment();
+		return NULL;
+	}
+
+	/* a new file is sized, and zeroed, by the first cluster */
+	fresh = (st.st_size == 0);
+	if (fresh)
+	{
+		if (ftruncate(worker_host_fd, sizeof(PgTimeoutHostSegment)) != 0)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not initialize pg_timeout.host_segment \"%s\": %m",
+							path)));
+			pg_timeout_unmap_host_segment();
+			return NULL;
+		}
+	}
+	else if (st.st_size != sizeof(PgTimeoutHostSegment))
+	{
+		ereport(WARNING,
+				(errmsg("pg_timeout.host_segment \"%s\" is not a pg_timeout host segment",
+						path),
+				 errdetail("Its size is %lld bytes, expected %zu.",
+						   (long long) st.st_size,
+						   sizeof(PgTimeoutHostSegment))));
+		pg_timeout_unmap_host_segment();
+		return NULL;
+	}
+
+	addr = mmap(NULL, sizeof(PgTimeoutHostSegment), PROT_READ | PROT_WRITE,
+				MAP_SHARED, worker_host_fd, 0);
+	if (addr == MAP_FAILED)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not map pg_timeout.host_segment \"%s\": %m",
+						path)));
+		pg_timeout_unmap_host_segment();
+		return NULL;
+	}
+	worker_host = (PgTimeoutHostSegment *) addr;
+
+	if (fresh)
+	{
+		worker_host->magic = HOST_SEGMENT_MAGIC;
+		worker_host->version = HOST_SEGMENT_VERSION;
+	}
+	else if (worker_host->magic != HOST_SEGMENT_MAGIC)
+	{
+		ereport(WARNING,
+				(errmsg("pg_timeout.host_segment \"%s\" is not a pg_timeout host segment",
+						path)));
+		pg_timeout_unmap_host_segment();
+		return NULL;
+	}
+	else if (worker_host->version != HOST_SEGMENT_VERSION)
+	{
+		ereport(WARNING,
+				(errmsg("pg_timeout.host_segment \"%s\" has version %u, expected %u",
+						path, worker_host->version, HOST_SEGMENT_VERSION)));
+		pg_timeout_unmap_host_segment();
+		return NULL;
+	}
+
+	flock(worker_host_fd, LOCK_UN);
+
+	return worker_host;
+}
+
+/*
+ * Entry of this cluster in the segment, claiming a free one if needed.  NULL
+ * if all are taken.  The entries of clusters which are gone, or whose
+ * worker has not updated them for HOST_SLOT_STALE_NAPTIMES of their
+ * naptime (it was stopped, or crashed), are freed on the way.  The segment
+ * must be locked.
+ */
+static PgTimeoutHostSlot *
+pg_timeout_host_slot(PgTimeoutHostSegment *host, TimestampTz now)
+{
+	PgTimeoutHostSlot *self = NULL;
+	PgTimeoutHostSlot *free_slot = NULL;
+	int			i;
+
+	for (i = 0; i < MAX_HOST_CLUSTERS; i++)
+	{
+		PgTimeoutHostSlot *slot = &host->slots[i];
+
+		if (slot->postmaster_pid == PostmasterPid)
+		{
+			self = slot;
+			continue;
+		}
+
+		/* clusters of other users are seen alive (EPERM) */
+		if (slot->postmaster_pid != 0 &&
+			((kill(slot->postmaster_pid, 0) != 0 && errno == ESRCH) ||
+			 now - slot->updated >
+			 (HOST_SLOT_STALE_NAPTIMES * slot->naptime_ms + 1000) * 1000))
+			memset(slot, 0, sizeof(PgTimeoutHostSlot));
+
+		if (slot->postmaster_pid == 0 && free_slot == NULL)
+			free_slot = slot;
+	}
+
+	if (self == NULL && free_slot != NULL)
+	{
+		self = free_slot;
+		self->postmaster_pid = PostmasterPid;
+		strlcpy(self->data_directory, DataDir, sizeof(self->data_directory));
+	}
+
+	return self;
+}
+
+static int
+pg_timeout_host_slot_cmp(const void *a, const void *b)
+{
+	const PgTimeoutHostSlot *sa = *(PgTimeoutHostSlot *const *) a;
+	const PgTimeoutHostSlot *sb = *(PgTimeoutHostSlot *const *) b;
+
+	if (sa->idle_memory_kb > sb->idle_memory_kb)
+		return -1;
+	if (sa->idle_memory_kb < sb->idle_memory_kb)
+		return 1;
+	if (sa->postmaster_pid < sb->postmaster_pid)
+		return -1;
+	if (sa->postmaster_pid > sb->postmaster_pid)
+		return 1;
+	return 0;
+}
+
+static int
+pg_timeout_memory_cmp(const void *a, const void *b)
+{
+	const PgTimeoutCandidate *ca = *(PgTimeoutCandidate *const *) a;
+	const PgTimeoutCandidate *cb = *(PgTimeoutCandidate *const *) b;
+
+	if (ca->memory_kb > cb->memory_kb)
+		return -1;
+	if (ca->memory_kb < cb->memory_kb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Publish the idle sessions of this cluster and their memory in the file of
+ * pg_timeout.host_segment, and when the memory used on the host exceeds
+ * pg_timeout.host_memory_threshold percent, free this cluster's share of
+ * the excess.
+ *
+ * Only the memory of the sessions which can be terminated, idle for
+ * pg_timeout.pressure_min_idle and not exempted, is published.  Without
+ * pg_timeout.host_memory_threshold, it is not read and published as 0, so
+ * that the other clusters do not count on this one to free it.
+ *
+ * The excess, less what the other clusters are already freeing, is
+ * allocated to the clusters by decreasing idle memory, each one up to its
+ * idle memory, so that whichever worker wakes first, the eviction falls on
+ * the clusters which have the most to give back.  The share of this
+ * cluster is then freed by terminating its idle sessions, largest first.
+ * All workers read the same segment under the same lock, so they agree on
+ * the allocation.
+ */
+static void
+pg_timeout_coordinate_host(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	PgTimeoutHostSegment *host;
+	PgTimeoutHostSlot *self;
+	PgTimeoutHostSlot *clusters[MAX_HOST_CLUSTERS];
+	PgTimeoutCandidate **eligible;
+	int			nclusters = 0;
+	int			neligible = 0;
+	int			nidle = 0;
+	int64		idle_memory_kb = 0;
+	int64		total_kb;
+	int64		available_kb;
+	int64		excess_kb = 0;
+	int64		share_kb = 0;
+	int64		evicting_kb = 0;
+	int			i;
+
+	host = pg_timeout_map_host_segment(policy->host_segment);
+	if (host == NULL)
+		return;
+
+	eligible = palloc(sizeof(PgTimeoutCandidate *) * Max(scan->ncandidates, 1));
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+
+		if (c->terminate || c->exempt != 0 || c->state != STATE_IDLE)
+			continue;
+
+		nidle++;
+		if (c->idle_ms < policy->pressure_min_idle_ms)
+			continue;
+
+		/* only the memory this cluster can free is published */
+		if (policy->host_memory_threshold > 0)
+		{
+			if (c->memory_kb == 0)
+				c->memory_kb = pg_timeout_backend_memory(c->pid);
+			idle_memory_kb += c->memory_kb;
+		}
+		eligible[neligible++] = c;
+	}
+
+	if (policy->host_memory_threshold > 0 &&
+		pg_timeout_host_memory(&total_kb, &available_kb))
+		excess_kb = (total_kb - available_kb) -
+			total_kb * policy->host_memory_threshold / 100;
+
+	if (flock(worker_host_fd, LOCK_EX) != 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not lock pg_timeout.host_segment \"%s\": %m",
+						policy->host_segment)));
+		pfree(eligible);
+		return;
+	}
+
+	self = pg_timeout_host_slot(host, scan->now);
+	if (self == NULL)
+	{
+		flock(worker_host_fd, LOCK_UN);
+		ereport(WARNING,
+				(errmsg("pg_timeout.host_segment \"%s\" is full",
+						policy->host_segment),
+				 errdetail("At most %d clusters can share it.",
+						   MAX_HOST_CLUSTERS)));
+		pfree(eligible);
+		return;
+	}
+	self->idle_sessions = nidle;
+	self->idle_memory_kb = idle_memory_kb;
+	self->evicting_kb = 0;
+	self->naptime_ms = policy->naptime_ms;
+	self->updated = scan->now;
+
+	if (excess_kb > 0)
+	{
+		for (i = 0; i < MAX_HOST_CLUSTERS; i++)
+		{
+			PgTimeoutHostSlot *slot = &host->slots[i];
+
+			if (slot->postmaster_pid == 0)
+				continue;
+			excess_kb -= slot->evicting_kb;
+			clusters[nclusters++] = slot;
+		}
+
+		qsort(clusters, nclusters, sizeof(PgTimeoutHostSlot *),
+			  pg_timeout_host_slot_cmp);
+
+		for (i = 0; i < nclusters && excess_kb > 0; i++)
+		{
+			int64		allocated = Min(clusters[i]->idle_memory_kb, excess_kb);
+
+			if (clusters[i] == self)
+				share_kb = allocated;
+			excess_kb -= allocated;
+		}
+	}
+
+	if (share_kb > 0)
+	{
+		qsort(eligible, neligible, sizeof(PgTimeoutCandidate *),
+			  pg_timeout_memory_cmp);
+
+		for (i = 0; i < neligible && evicting_kb < share_kb; i++)
+		{
+			PgTimeoutCandidate *c = eligible[i];
+
+			c->terminate = true;
+			c->priority = c->memory_kb / 1024.0;
+			snprintf(c->reason, sizeof(c->reason),
+					 "host_memory_pressure memory=%.1fMB",
+					 c->memory_kb / 1024.0);
+			evicting_kb += c->memory_kb;
+		}
+		self->idle_memory_kb -= evicting_kb;
+		self->evicting_kb = evicting_kb;
+	}
+
+	flock(worker_host_fd, LOCK_UN);
+
+	pfree(eligible);
+}
+
+#endif
+
+/*
+ * Notify on channel pg_timeout the idle sessions which will reach their
+ * timeout within pg_timeout.warning_time, once per idle period, so that
+ * connection pools listening on it can close them first.  The payload is a
+ * JSON object with the pid, the database and the deadline.  Notifications
+ * are only delivered to the listeners of the worker's database, which
+ * receive those of all databases.
+ *
+ * All notifications of a check are sent at once when the worker commits.
+ */
+static void
+pg_timeout_send_warnings(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	HASH_SEQ_STATUS status;
+	PgTimeoutWarned *warned;
+	int			nwarned = 0;
+	int			i;
+
+	if (policy->warning_time_ms == 0 || policy->policy_function[0] != '\0')
+		return;
+
+	/* NOTIFY needs a transaction id, which a standby cannot assign */
+	if (RecoveryInProgress())
+		return;
+
+	if (worker_warned == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(int);
+		ctl.entrysize = sizeof(PgTimeoutWarned);
+		worker_warned = hash_create("pg_timeout warned sessions", 64, &ctl,
+									HASH_ELEM | HASH_BLOBS);
+	}
+
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+		TimestampTz deadline;
+		StringInfoData payload;
+		char	   *datname;
+		bool		found;
+
+		if (c->terminate || c->timeout_ms < 0 ||
+			c->idle_ms < c->timeout_ms - policy->warning_time_ms)
+			continue;
+
+		warned = hash_search(worker_warned, &c->pid, HASH_ENTER, &found);
+		warned->last_seen = scan->now;
+		if (found && warned->state_change == c->state_change)
+			continue;
+		warned->state_change = c->state_change;
+
+		deadline = TimestampTzPlusMilliseconds(c->state_change, c->timeout_ms);
+		pg_timeout_begin_xact(scan);
+		datname = get_database_name(c->dbid);
+
+		initStringInfo(&payload);
+		appendStringInfo(&payload, "{\"pid\": %d, \"datname\": ", c->pid);
+		if (datname != NULL)
+			escape_json(&payload, datname);
+		else
+			appendStringInfoString(&payload, "null");
+		appendStringInfo(&payload, ", \"dbid\": %u, \"deadline\": \"%s\"}",
+						 c->dbid, timestamptz_to_str(deadline));
+		Async_Notify(WARNING_CHANNEL, payload.data);
+		pfree(payload.data);
+		nwarned++;
+	}
+
+	/* forget sessions which are gone or not idle anymore */
+	hash_seq_init(&status, worker_warned);
+	while ((warned = hash_seq_search(&status)) != NULL)
+	{
+		if (warned->last_seen != scan->now)
+			hash_search(worker_warned, &warned->pid, HASH_REMOVE, NULL);
+	}
+
+	if (nwarned > 0)
+		elog(DEBUG1, "%s: %d idle session(s) warned",
+			 MyBgworkerEntry->bgw_name, nwarned);
+}
+
+/*
+ * Format the client address of a candidate, return false for Unix-domain
+ * socket connections.
+ */
+static bool
+pg_timeout_format_addr(const SockAddr *addr, char *buf, size_t len)
+{
+	char	   *zone;
+
+	if (addr->addr.ss_family != AF_INET &&
+		addr->addr.ss_family != AF_INET6)
+		return false;
+
+	if (pg_getnameinfo_all(&addr->addr, addr->salen, buf, len,
+						   NULL, 0, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return false;
+
+	/* inet input does not accept an IPv6 zone */
+	zone = strchr(buf, '%');
+	if (zone != NULL)
+		*zone = '\0';
+
+	return true;
+}
+
+static ArrayType *
+pg_timeout_build_array(Datum *values, bool *nulls, int n, Oid elemtype)
+{
+	int			dims[1];
+	int			lbs[1];
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	dims[0] = n;
+	lbs[0] = 1;
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+	return construct_md_array(values, nulls, 1, dims, lbs,
+							  elemtype, typlen, typbyval, typalign);
+}
+
+/*
+ * Resolve pg_timeout.policy_function and prepare the statement calling it.
+ *
+ * The function must take an array of a composite type with the columns of
+ * pg_timeout_candidate and return int4[].  The plan is kept until the
+ * parameter is changed.
+ */
+static SPIPlanPtr
+pg_timeout_policy_plan(void)
+{
+	Oid			funcoid;
+	Oid		   *argtypes;
+	int			nargs;
+	Oid			rettype;
+	Oid			elemtype;
+	StringInfoData query;
+	SPIPlanPtr	plan;
+	Oid			paramtypes[8] = {INT4ARRAYOID, OIDARRAYOID, OIDARRAYOID,
+								 TEXTARRAYOID, TEXTARRAYOID,
+								 TIMESTAMPTZARRAYOID, TIMESTAMPTZARRAYOID,
+								 TIMESTAMPTZOID};
+
+	if (policy_plan != NULL &&
+		strcmp(policy_plan_function, worker_policy.policy_function) == 0)
+		return policy_plan;
+
+	if (policy_plan != NULL)
+	{
+		SPI_freeplan(policy_plan);
+		policy_plan = NULL;
+		pfree(policy_plan_function);
+		policy_plan_function = NULL;
+	}
+
+	funcoid = DatumGetObjectId(DirectFunctionCall1(regprocin,
+												   CStringGetDatum(worker_policy.policy_function)));
+	rettype = get_func_signature(funcoid, &argtypes, &nargs);
+	elemtype = nargs == 1 ? get_element_type(argtypes[0]) : InvalidOid;
+	if (rettype != INT4ARRAYOID || !OidIsValid(elemtype) ||
+		!type_is_rowtype(elemtype))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_FUNCTION_DEFINITION),
+				 errmsg("pg_timeout.policy_function \"%s\" must take an array of pg_timeout_candidate and return integer[]",
+						worker_policy.policy_function)));
+
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT %s(ARRAY("
+					 "SELECT ROW(c.pid, pg_catalog.pg_get_userbyid(c.roleid), "
+					 "(SELECT d.datname FROM pg_catalog.pg_database d WHERE d.oid = c.dbid), "
+					 "c.app, c.client_addr::pg_catalog.inet, "
+					 "$8 - c.state_change, $8 - c.xact_start)::%s "
+					 "FROM pg_catalog.unnest($1, $2, $3, $4, $5, $6, $7) "
+					 "AS c(pid, roleid, dbid, app, client_addr, state_change, xact_start)))",
+					 quote_qualified_identifier(get_namespace_name(get_func_namespace(funcoid)),
+												get_func_name(funcoid)),
+					 format_type_be_qualified(elemtype));
+
+	plan = SPI_prepare(query.data, 8, paramtypes);
+	if (plan == NULL)
+		elog(ERROR, "SPI_prepare failed for \"%s\": %s",
+			 query.data, SPI_result_code_string(SPI_result));
+	SPI_keepplan(plan);
+
+	policy_plan = plan;
+	policy_plan_function = MemoryContextStrdup(TopMemoryContext,
+											   worker_policy.policy_function);
+	pfree(query.data);
+
+	return policy_plan;
+}
+
+/*
+ * Replace the decision on the whole batch by the result of a single call of
+ * pg_timeout.policy_function.
+ */
+static void
+pg_timeout_apply_policy_function(PgTimeoutScan *scan)
+{
+	PgTimeoutCandidate *candidates = scan->candidates;
+	int			ncandidates = scan->ncandidates;
+	TimestampTz now = scan->now;
+	Datum	   *pids = palloc(sizeof(Datum) * ncandidates);
+	Datum	   *roles = palloc(sizeof(Datum) * ncandidates);
+	Datum	   *dbs = palloc(sizeof(Datum) * ncandidates);
+	Datum	   *apps = palloc(sizeof(Datum) * ncandidates);
+	Datum	   *addrs = palloc(sizeof(Datum) * ncandidates);
+	Datum	   *state_changes = palloc(sizeof(Datum) * ncandidates);
+	Datum	   *xact_starts = palloc(sizeof(Datum) * ncandidates);
+	bool	   *addr_nulls = palloc0(sizeof(bool) * ncandidates);
+	bool	   *state_change_nulls = palloc0(sizeof(bool) * ncandidates);
+	bool	   *xact_start_nulls = palloc0(sizeof(bool) * ncandidates);
+	Datum		values[8];
+	char		nulls[8];
+	SPIPlanPtr	plan;
+	int32	   *selected = NULL;
+	int			nselected = 0;
+	int			ret;
+	int			i;
+
+	/* building the arrays needs the catalogs */
+	pg_timeout_begin_xact(scan);
+
+	for (i = 0; i < ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &candidates[i];
+		char		addr[NI_MAXHOST];
+
+		pids[i] = Int32GetDatum(c->pid);
+		roles[i] = ObjectIdGetDatum(c->roleid);
+		dbs[i] = ObjectIdGetDatum(c->dbid);
+		apps[i] = CStringGetTextDatum(c->application_name);
+		if (pg_timeout_format_addr(&c->client_addr, addr, sizeof(addr)))
+			addrs[i] = CStringGetTextDatum(addr);
+		else
+			addr_nulls[i] = true;
+		state_changes[i] = TimestampTzGetDatum(c->state_change);
+		state_change_nulls[i] = (c->state_change == 0);
+		xact_starts[i] = TimestampTzGetDatum(c->xact_start);
+		xact_start_nulls[i] = (c->xact_start == 0);
+	}
+
+	values[0] = PointerGetDatum(pg_timeout_build_array(pids, NULL, ncandidates, INT4OID));
+	values[1] = PointerGetDatum(pg_timeout_build_array(roles, NULL, ncandidates, OIDOID));
+	values[2] = PointerGetDatum(pg_timeout_build_array(dbs, NULL, ncandidates, OIDOID));
+	values[3] = PointerGetDatum(pg_timeout_build_array(apps, NULL, ncandidates, TEXTOID));
+	values[4] = PointerGetDatum(pg_timeout_build_array(addrs, addr_nulls, ncandidates, TEXTOID));
+	values[5] = PointerGetDatum(pg_timeout_build_array(state_changes, state_change_nulls,
+													   ncandidates, TIMESTAMPTZOID));
+	values[6] = PointerGetDatum(pg_timeout_build_array(xact_starts, xact_start_nulls,
+													   ncandidates, TIMESTAMPTZOID));
+	values[7] = TimestampTzGetDatum(now);
+	memset(nulls, ' ', sizeof(nulls));
+
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	plan = pg_timeout_policy_plan();
+	ret = SPI_execute_plan(plan, values, nulls, true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "cannot execute pg_timeout.policy_function: error code %d",
+			 ret);
+
+	if (SPI_processed == 1)
+	{
+		bool		isnull;
+		Datum		result;
+
+		result = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+							   1, &isnull);
+		if (!isnull)
+		{
+			ArrayType  *arr = DatumGetArrayTypeP(result);
+			Datum	   *elems;
+			bool	   *elem_nulls;
+			int			nelems;
+
+			/* the result must survive SPI_finish() */
+			selected = SPI_palloc(sizeof(int32) *
+								  Max(ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr)), 1));
+
+			deconstruct_array(arr, INT4OID, sizeof(int32), true, TYPALIGN_INT,
+							  &elems, &elem_nulls, &nelems);
+			for (i = 0; i < nelems; i++)
+				if (!elem_nulls[i])
+					selected[nselected++] = DatumGetInt32(elems[i]);
+		}
+	}
+
+	PopActiveSnapshot();
+	SPI_finish();
+
+	if (nselected > 1)
+		qsort(selected, nselected, sizeof(int32), pg_timeout_pid_cmp);
+
+	for (i = 0; i < ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &candidates[i];
+
+		/* exempted sessions only have their own timeout */
+		if (c->exempt != 0)
+			continue;
+
+		c->terminate = (nselected > 0 &&
+						bsearch(&c->pid, selected, nselected, sizeof(int32),
+								pg_timeout_pid_cmp) != NULL);
+		if (c->terminate)
+			snprintf(c->reason, sizeof(c->reason), "policy_function");
+		else
+			c->reason[0] = '\0';
+	}
+}
+
+static int
+pg_timeout_proc_wait_cmp(const void *a, const void *b)
+{
+	int			pa = ((const PgTimeoutProcWait *) a)->pid;
+	int			pb = ((const PgTimeoutProcWait *) b)->pid;
+
+	if (pa < pb)
+		return -1;
+	if (pa > pb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Record the state of each non-idle client backend in the history ring.
+ *
+ * Like the check, this only reads the backend status array and the proc
+ * array, without a transaction; the wait events, which are not part of the
+ * backend status, are read from the proc array without lock like
+ * pg_stat_activity does.
+ */
+static void
+pg_timeout_sample(TimestampTz now)
+{
+	int			nbackends;
+	int			nprocs = ProcGlobal->allProcCount;
+	PgTimeoutProcWait *waits;
+	PgTimeoutSample *samples;
+	PgTimeoutSample *history;
+	int			nsamples = 0;
+	int			i;
+
+	if (pgts->history_size == 0)
+		return;
+
+	waits = palloc(sizeof(PgTimeoutProcWait) * Max(nprocs, 1));
+	for (i = 0; i < nprocs; i++)
+	{
+		PGPROC	   *proc = &ProcGlobal->allProcs[i];
+
+		waits[i].pid = proc->pid;
+		waits[i].wait_event_info = UINT32_ACCESS_ONCE(proc->wait_event_info);
+	}
+	qsort(waits, nprocs, sizeof(PgTimeoutProcWait), pg_timeout_proc_wait_cmp);
+
+	nbackends = pgstat_fetch_stat_numbackends();
+	samples = palloc(sizeof(PgTimeoutSample) * Max(nbackends, 1));
+
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+		PgTimeoutSample *s;
+		PgTimeoutProcWait key;
+		PgTimeoutProcWait *wait;
+
+		if (local == NULL)
+			continue;
+		be = &local->backendStatus;
+
+		if (be->st_backendType != B_BACKEND ||
+			be->st_procpid <= 0 ||
+			be->st_procpid == MyProcPid ||
+			be->st_state == STATE_IDLE ||
+			be->st_state == STATE_UNDEFINED)
+			continue;
+
+		key.pid = be->st_procpid;
+		wait = bsearch(&key, waits, nprocs, sizeof(PgTimeoutProcWait),
+					   pg_timeout_proc_wait_cmp);
+
+		s = &samples[nsamples++];
+		s->sample_time = now;
+		s->pid = be->st_procpid;
+		s->roleid = be->st_userid;
+		s->dbid = be->st_databaseid;
+		s->state = be->st_state;
+		s->wait_event_info = wait ? wait->wait_event_info : 0;
+		s->query_id = (int64) be->st_query_id;
+	}
+
+	pgstat_clear_snapshot();
+
+	history = pg_timeout_history(pgts);
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	for (i = 0; i < nsamples; i++)
+		history[pgts->history_count++ % pgts->history_size] = samples[i];
+	LWLockRelease(&pgts->lock);
+}
+
+/*
+ * Replay lag of a standby in ms: age of the last transaction replayed, or 0
+ * when all the WAL received has been replayed, so that a primary without
+ * activity does not look like a lag.
+ */
+static int64
+pg_timeout_replay_lag(TimestampTz now)
+{
+	XLogRecPtr	received = GetWalRcvFlushRecPtr(NULL, NULL);
+	XLogRecPtr	replayed = GetXLogReplayRecPtr(NULL);
+	TimestampTz last_replayed;
+
+	if (received <= replayed)
+		return 0;
+
+	last_replayed = GetLatestXTime();
+	if (last_replayed == 0 || last_replayed >= now)
+		return 0;
+
+	return (now - last_replayed) / 1000;
+}
+
+/*
+ * Whether the startup process is waiting for sessions whose snapshot
+ * conflicts with the rows removed by the record being replayed.
+ */
+static bool
+pg_timeout_replay_waits_on_snapshots(void)
+{
+	int			nbackends = pgstat_fetch_stat_numbackends();
+	int			i;
+
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PGPROC	   *proc;
+
+		if (local == NULL || local->backendStatus.st_backendType != B_STARTUP)
+			continue;
+
+		proc = AuxiliaryPidGetProc(local->backendStatus.st_procpid);
+		return proc != NULL &&
+			UINT32_ACCESS_ONCE(proc->wait_event_info) ==
+			WAIT_EVENT_RECOVERY_CONFLICT_SNAPSHOT;
+	}
+
+	return false;
+}
+
+/*
+ * Whether a session may be terminated for a replay conflict: an idle or
+ * idle in transaction client session holding a snapshot.  Active sessions
+ * are left to max_standby_streaming_delay.
+ */
+static bool
+pg_timeout_replay_conflict_eligible(LocalPgBackendStatus *local)
+{
+	PgBackendStatus *be = &local->backendStatus;
+
+	return TransactionIdIsValid(local->backend_xmin) &&
+		be->st_backendType == B_BACKEND &&
+		be->st_procpid > 0 &&
+		be->st_procpid != MyProcPid &&
+		(be->st_state == STATE_IDLE ||
+		 be->st_state == STATE_IDLEINTRANSACTION ||
+		 be->st_state == STATE_IDLEINTRANSACTION_ABORTED);
+}
+
+/*
+ * On a standby lagging by more than pg_timeout.standby_lag_threshold while
+ * the startup process waits on a snapshot conflict, terminate the idle and
+ * idle in transaction sessions holding the oldest snapshot: their xmin is
+ * what replay waits for before removing rows (and, with
+ * hot_standby_feedback, what keeps the primary from vacuuming them).  The
+ * sessions with a newer snapshot are only terminated at the next checks
+ * if replay still waits once the oldest ones are gone.
+ *
+ * Idle in transaction sessions are not part of the batch: they are added
+ * here, from the same copy of the backend status array, after the other
+ * decisions.
+ */
+static void
+pg_timeout_resolve_replay_conflicts(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	TransactionId oldest_xmin = InvalidTransactionId;
+	int			nbackends;
+	int			nidle = scan->ncandidates;
+	int			k = 0;
+	int64		lag;
+	int			i;
+
+	if (policy->standby_lag_threshold_ms == 0 || !RecoveryInProgress())
+		return;
+
+	lag = pg_timeout_replay_lag(scan->now);
+	if (lag < policy->standby_lag_threshold_ms ||
+		!pg_timeout_replay_waits_on_snapshots())
+		return;
+
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+
+		if (local != NULL && pg_timeout_replay_conflict_eligible(local) &&
+			(!TransactionIdIsValid(oldest_xmin) ||
+			 TransactionIdPrecedes(local->backend_xmin, oldest_xmin)))
+			oldest_xmin = local->backend_xmin;
+	}
+
+	if (!TransactionIdIsValid(oldest_xmin))
+		return;
+
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+		PgTimeoutCandidate *c;
+
+		if (local == NULL || !pg_timeout_replay_conflict_eligible(local) ||
+			local->backend_xmin != oldest_xmin)
+			continue;
+		be = &local->backendStatus;
+
+		if (be->st_state == STATE_IDLE)
+		{
+			int			j = k;
+
+			/* the batch is in the order of the array */
+			while (j < nidle && scan->candidates[j].pid != be->st_procpid)
+				j++;
+			if (j == nidle)
+				continue;
+			k = j;
+			c = &scan->candidates[k];
+
+			/* exempted sessions kept without a timeout */
+			if (c->timeout_ms < 0)
+				continue;
+		}
+		else
+			c = pg_timeout_fill_candidate(scan, be);
+
+		c->terminate = true;
+		c->priority = 1e9 + c->idle_ms / 1000.0;
+		snprintf(c->reason, sizeof(c->reason),
+				 "standby_replay_lag=%.3fs xmin=%u", lag / 1000.0,
+				 local->backend_xmin);
+	}
+}
+
+/*
+ * Size of the temporary files of a backend.
+ */
+typedef struct PgTimeoutTempUsage
+{
+	int			pid;
+	int64		bytes;
+	int			candidate;		/* index in the batch, -1 if not there */
+} PgTimeoutTempUsage;
+
+/*
+ * Add the files of a temporary directory to their backend in usage, by the
+ * PID in their name: pgsql_tmp<PID>.<n> for the files of a backend, or a
+ * pgsql_tmp<PID>.<n>.fileset directory for the files shared by the workers
+ * of a parallel query, owned by its leader.  Files may be removed while
+ * they are read, which is not an error.
+ */
+static void
+pg_timeout_scan_temp_dir(HTAB *usage, const char *dirname, int pid)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	char		path[MAXPGPATH * 2];
+
+	dir = AllocateDir(dirname);
+	if (dir == NULL && errno == ENOENT)
+		return;
+
+	while ((de = ReadDirExtended(dir, dirname, LOG)) != NULL)
+	{
+		struct stat st;
+		int			owner = pid;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (owner == 0)
+		{
+			char	   *end;
+
+			if (strncmp(de->d_name, PG_TEMP_FILE_PREFIX,
+						strlen(PG_TEMP_FILE_PREFIX)) != 0)
+				continue;
+			owner = (int) strtol(de->d_name + strlen(PG_TEMP_FILE_PREFIX),
+								 &end, 10);
+			if (*end != '.' || owner <= 0)
+				continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		if (lstat(path, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (pid == 0)
+				pg_timeout_scan_temp_dir(usage, path, owner);
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			PgTimeoutTempUsage *entry;
+			bool		found;
+
+			entry = hash_search(usage, &owner, HASH_ENTER, &found);
+			if (!found)
+			{
+				entry->bytes = 0;
+				entry->candidate = -1;
+			}
+			entry->bytes += st.st_size;
+		}
+	}
+
+	FreeDir(dir);
+}
+
+/*
+ * Terminate first the idle and idle in transaction sessions whose temporary
+ * files take more than pg_timeout.temp_files_threshold: left by an open
+ * cursor or an unfinished sort, that space is only released when the
+ * session goes away.  The temporary directory of the default tablespace
+ * and of each other tablespace is read at each check.
+ *
+ * Idle in transaction sessions are added to the batch like for the replay
+ * conflicts, unless they already are.
+ */
+static void
+pg_timeout_enforce_temp_files(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	HTAB	   *usage;
+	HASHCTL		ctl;
+	DIR		   *dir;
+	struct dirent *de;
+	char		path[MAXPGPATH * 2];
+	int			nbackends;
+	int			i;
+
+	if (policy->temp_files_threshold_kb == 0)
+		return;
+
+	ctl.keysize = sizeof(int);
+	ctl.entrysize = sizeof(PgTimeoutTempUsage);
+	ctl.hcxt = CurrentMemoryContext;
+	usage = hash_create("pg_timeout temporary files", 64, &ctl,
+						HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pg_timeout_scan_temp_dir(usage, "base/" PG_TEMP_FILES_DIR, 0);
+
+	dir = AllocateDir("pg_tblspc");
+	while ((de = ReadDirExtended(dir, "pg_tblspc", LOG)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "pg_tblspc/%s/%s/%s", de->d_name,
+				 TABLESPACE_VERSION_DIRECTORY, PG_TEMP_FILES_DIR);
+		pg_timeout_scan_temp_dir(usage, path, 0);
+	}
+	FreeDir(dir);
+
+	if (hash_get_num_entries(usage) == 0)
+		return;
+
+	/* find the owners in the batch once, not for each of them */
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutTempUsage *entry = hash_search(usage, &scan->candidates[i].pid,
+												HASH_FIND, NULL);
+
+		if (entry != NULL)
+			entry->candidate = i;
+	}
+
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+		PgTimeoutTempUsage *entry;
+		PgTimeoutCandidate *c;
+
+		if (local == NULL)
+			continue;
+		be = &local->backendStatus;
+
+		if (be->st_backendType != B_BACKEND ||
+			be->st_procpid <= 0 ||
+			be->st_procpid == MyProcPid)
+			continue;
+		if (be->st_state != STATE_IDLE &&
+			be->st_state != STATE_IDLEINTRANSACTION &&
+			be->st_state != STATE_IDLEINTRANSACTION_ABORTED)
+			continue;
+
+		entry = hash_search(usage, &be->st_procpid, HASH_FIND, NULL);
+		if (entry == NULL || entry->bytes / 1024 < policy->temp_files_threshold_kb)
+			continue;
+
+		if (entry->candidate < 0)
+		{
+			/* idle sessions are all in the batch */
+			if (be->st_state == STATE_IDLE)
+				continue;
+
+			c = pg_timeout_fill_candidate(scan, be);
+		}
+		else
+		{
+			c = &scan->candidates[entry->candidate];
+			if (c->exempt != 0)
+				continue;
+		}
+
+		c->terminate = true;
+		c->priority = 2e9 + entry->bytes / (1024.0 * 1024.0);
+		snprintf(c->reason, sizeof(c->reason), "temp_files=%.1fMB",
+				 entry->bytes / (1024.0 * 1024.0));
+	}
+}
+
+/*
+ * Evaluate pg_timeout.shadow_policies in place of pg_timeout.policies on the
+ * batch, once the live decision is final, and record the sessions on which
+ * they differ.  A session selected by the shadow policies only is counted
+ * once per idle period.  Sessions exempted by pg_timeout.exemptions keep
+ * their live timeout, while the ones exempted by pg_timeout.policies only
+ * are evaluated like the others.
+ */
+static void
+pg_timeout_evaluate_shadow(PgTimeoutScan *scan)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	PgTimeoutShadowDiff *diffs;
+	HASH_SEQ_STATUS status;
+	PgTimeoutWarned *shadowed;
+	int			ndiffs = 0;
+	int64		nboth = 0;
+	int64		nshadow_only = 0;
+	int64		nlive_only = 0;
+	int			i;
+
+	if (policy->nshadow_rules == 0)
+		return;
+
+	if (worker_shadowed == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(int);
+		ctl.entrysize = sizeof(PgTimeoutWarned);
+		worker_shadowed = hash_create("pg_timeout shadowed sessions", 64, &ctl,
+									  HASH_ELEM | HASH_BLOBS);
+	}
+
+	diffs = palloc(sizeof(PgTimeoutShadowDiff) * Max(scan->ncandidates, 1));
+
+	for (i = 0; i < scan->ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &scan->candidates[i];
+		PgTimeoutShadowDiff *diff;
+		int64		shadow_timeout;
+		bool		shadow_terminate;
+
+		if (c->state != STATE_IDLE)
+			continue;
+
+		if ((c->exempt & ~PG_TIMEOUT_EXEMPT_POLICY) != 0)
+			shadow_timeout = c->timeout_ms;
+		else
+		{
+			PgTimeoutRule *rule = pg_timeout_match_rule(policy->shadow_rules,
+														policy->nshadow_rules, c);
+
+			if (rule != NULL && rule->exempt)
+				shadow_timeout = policy->exempt_timeout_ms > 0 ?
+					policy->exempt_timeout_ms : -1;
+			else
+				shadow_timeout = pg_timeout_rule_timeout(scan, c, rule);
+		}
+		shadow_terminate = (shadow_timeout >= 0 && c->idle_ms >= shadow_timeout);
+
+		if (shadow_terminate && c->terminate)
+		{
+			nboth++;
+			continue;
+		}
+		if (!shadow_terminate && !c->terminate)
+			continue;
+
+		if (shadow_terminate)
+		{
+			bool		found;
+
+			shadowed = hash_search(worker_shadowed, &c->pid, HASH_ENTER, &found);
+			shadowed->last_seen = scan->now;
+			if (found && shadowed->state_change == c->state_change)
+				continue;
+			shadowed->state_change = c->state_change;
+			nshadow_only++;
+		}
+		else
+			nlive_only++;
+
+		diff = &diffs[ndiffs++];
+		diff->time = scan->now;
+		diff->pid = c->pid;
+		diff->roleid = c->roleid;
+		diff->dbid = c->dbid;
+		strlcpy(diff->application_name, c->application_name, NAMEDATALEN);
+		diff->idle_ms = c->idle_ms;
+		diff->live_timeout_ms = c->timeout_ms;
+		diff->shadow_timeout_ms = shadow_timeout;
+		diff->shadow_terminate = shadow_terminate;
+	}
+
+	hash_seq_init(&status, worker_shadowed);
+	while ((shadowed = hash_seq_search(&status)) != NULL)
+	{
+		if (shadowed->last_seen != scan->now)
+			hash_search(worker_shadowed, &shadowed->pid, HASH_REMOVE, NULL);
+	}
+
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	pgts->shadow_both += nboth;
+	pgts->shadow_only += nshadow_only;
+	pgts->live_only += nlive_only;
+	for (i = 0; i < ndiffs; i++)
+		pgts->shadow_diffs[pgts->shadow_count++ % MAX_SHADOW_DIFFS] = diffs[i];
+	LWLockRelease(&pgts->lock);
+
+	pfree(diffs);
+}
+
+/*
+ * One check: find idle sessions, select the ones over the timeout (or
+ * chosen by the policy function), add more for the roles and databases
+ * over their idle quota, under connection or host memory pressure, holding
+ * back the replay of a standby and holding temporary files, let the hooks
+ * amend the decision and terminate the sessions that remain selected.
+ *
+ * The scan itself does not need a transaction: one is only started when
+ * needed, see pg_timeout_begin_xact().  Returns the number of sessions
+ * signalled.
+ */
+static int
+pg_timeout_check(void)
+{
+	PgTimeoutScan scan;
+	PgTimeoutCandidate *candidates;
+	int			ncandidates;
+	int			nterminated = 0;
+	int			i;
+
+	scan.now = GetCurrentTimestamp();
+	scan.in_xact = false;
+	pg_timeout_collect(&scan);
+	pg_timeout_apply_exemptions(&scan);
+	candidates = scan.candidates;
+	ncandidates = scan.ncandidates;
+
+	if (worker_policy.policy_function[0] != '\0' && ncandidates > 0)
+		pg_timeout_apply_policy_function(&scan);
+
+	pg_timeout_enforce_quotas(&scan);
+	pg_timeout_evict_under_pressure(&scan);
+#ifndef WIN32
+	pg_timeout_coordinate_host(&scan);
+#endif
+	pg_timeout_resolve_replay_conflicts(&scan);
+	pg_timeout_enforce_temp_files(&scan);
+	ncandidates = scan.ncandidates;
+
+	/* hooks may access the catalogs */
+	if (pg_timeout_candidate_hook && ncandidates > 0)
+	{
+		pg_timeout_begin_xact(&scan);
+		(*pg_timeout_candidate_hook) (candidates, ncandidates);
+	}
+
+	pg_timeout_evaluate_shadow(&scan);
+
+	pg_timeout_send_warnings(&scan);
+
+	qsort(candidates, ncandidates, sizeof(PgTimeoutCandidate),
+		  pg_timeout_candidate_cmp);
+
+	for (i = 0; i < ncandidates; i++)
+	{
+		PgTimeoutCandidate *c = &candidates[i];
+		char	   *usename_val;
+		char	   *datname_val;
+
+		if (!c->terminate)
+			continue;
+
+		pg_timeout_begin_xact(&scan);
+		usename_val = GetUserNameFromId(c->roleid, true);
+		datname_val = get_database_name(c->dbid);
+		if (usename_val == NULL)
+			usename_val = null_value;
+		if (datname_val == NULL)
+			datname_val = null_value;
+
+		elog(LOG, LOG_MESSAGE " reason=%s",
+			 MyBgworkerEntry->bgw_name, c->pid, usename_val,
+			 datname_val,
+			 c->application_name[0] ? c->application_name : null_value,
+			 c->client_hostname[0] ? c->client_hostname : null_value,
+			 c->reason[0] ? c->reason : null_value);
+
+		if (!pg_timeout_signal_backend(c->pid))
+			continue;
+		pg_timeout_track_termination(c->pid, c->backend_start,
+									 GetCurrentTimestamp());
+
+		/* keep the signalled sessions at the front for the hook */
+		if (nterminated != i)
+			candidates[nterminated] = *c;
+		nterminated++;
+	}
+
+	if (nterminated > 0)
+	{
+		elog(LOG, "%s: %d idle session(s) terminated",
+			 MyBgworkerEntry->bgw_name, nterminated);
+
+		if (pg_timeout_terminated_hook)
+			(*pg_timeout_terminated_hook) (candidates, nterminated);
+	}
+
+	/*
+	 * Committing releases the local copy of the backend status array;
+	 * without a transaction it must be released explicitly.
+	 */
+	if (scan.in_xact)
+	{
+		CommitTransactionCommand();
+		pgstat_report_stat(false);
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+	else
+		pgstat_clear_snapshot();
+
+	return nterminated;
+}
+
+/*
+ * Whether a database is being drained.
+ */
+static bool
+pg_timeout_draining(TimestampTz now)
+{
+	bool		draining = false;
+	int			i;
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	for (i = 0; i < MAX_DRAINS; i++)
+		if (OidIsValid(pgts->drains[i].dbid) && pgts->drains[i].deadline > now)
+			draining = true;
+	LWLockRelease(&pgts->lock);
+
+	return draining;
+}
+
+/*
+ * Terminate the idle sessions of the databases being drained.  Called every
+ * DRAIN_INTERVAL_MS while a drain is in progress, so that a session is
+ * terminated soon after its current transaction ends.  Returns the number
+ * of sessions signalled.
+ */
+static int
+pg_timeout_drain_sessions(TimestampTz now)
+{
+	PgTimeoutDrain drains[MAX_DRAINS];
+	PgTimeoutScan scan;
+	int			ndrains = 0;
+	int			nbackends;
+	int			nterminated = 0;
+	int			i;
+	int			j;
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	for (i = 0; i < MAX_DRAINS; i++)
+		if (OidIsValid(pgts->drains[i].dbid) && pgts->drains[i].deadline > now)
+			drains[ndrains++] = pgts->drains[i];
+	LWLockRelease(&pgts->lock);
+
+	if (ndrains == 0)
+		return 0;
+
+	scan.now = now;
+	scan.in_xact = false;
+
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+		char	   *usename_val;
+		char	   *datname_val;
+
+		if (local == NULL)
+			continue;
+		be = &local->backendStatus;
+
+		if (be->st_backendType != B_BACKEND ||
+			be->st_procpid <= 0 ||
+			be->st_procpid == MyProcPid ||
+			be->st_state != STATE_IDLE)
+			continue;
+
+		for (j = 0; j < ndrains; j++)
+			if (drains[j].dbid == be->st_databaseid &&
+				drains[j].requester != be->st_procpid)
+				break;
+		if (j == ndrains)
+			continue;
+
+		/* already signalled, not gone yet */
+		if (worker_pending != NULL &&
+			hash_search(worker_pending, &be->st_procpid, HASH_FIND, NULL) != NULL)
+			continue;
+
+		pg_timeout_begin_xact(&scan);
+		usename_val = GetUserNameFromId(be->st_userid, true);
+		datname_val = get_database_name(be->st_databaseid);
+
+		elog(LOG, LOG_MESSAGE " reason=drain",
+			 MyBgworkerEntry->bgw_name, be->st_procpid,
+			 usename_val ? usename_val : null_value,
+			 datname_val ? datname_val : null_value,
+			 be->st_appname && be->st_appname[0] ? be->st_appname : null_value,
+			 be->st_clienthostname && be->st_clienthostname[0] ?
+			 be->st_clienthostname : null_value);
+
+		if (!pg_timeout_signal_backend(be->st_procpid))
+			continue;
+		pg_timeout_track_termination(be->st_procpid,
+									 be->st_proc_start_timestamp,
+									 GetCurrentTimestamp());
+		drains[j].terminated++;
+		nterminated++;
+	}
+
+	if (nterminated > 0)
+	{
+		LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+		for (j = 0; j < ndrains; j++)
+		{
+			for (i = 0; i < MAX_DRAINS; i++)
+				if (pgts->drains[i].dbid == drains[j].dbid &&
+					pgts->drains[i].requester == drains[j].requester)
+					pgts->drains[i].terminated = drains[j].terminated;
+		}
+		pgts->terminated += nterminated;
+		LWLockRelease(&pgts->lock);
+	}
+
+	if (scan.in_xact)
+	{
+		CommitTransactionCommand();
+		pgstat_report_stat(false);
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+	else
+		pgstat_clear_snapshot();
+
+	return nterminated;
+}
+
+/*
+ * CPU time used by the worker so far, in milliseconds.
+ */
+static double
+pg_timeout_cpu_time(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+}
+
+/*
+ * Interval between two checks: naptime, or with pg_timeout.max_cpu_percent
+ * the shortest interval between pg_timeout.min_naptime and naptime at which
+ * the checks, at their measured cost, stay within the budget.
+ */
+static int64
+pg_timeout_check_interval(void)
+{
+	PgTimeoutPolicy *policy = &worker_policy;
+	int64		interval;
+
+	if (policy->max_cpu_percent <= 0 || worker_check_cpu_ms < 0)
+		return policy->naptime_ms;
+
+	interval = (int64) ceil(worker_check_cpu_ms * 100.0 / policy->max_cpu_percent);
+
+	return Min(Max(interval, policy->min_naptime_ms), policy->naptime_ms);
+}
+
+/*
+ * Time of the next check: after the check interval, sooner when a schedule
+ * window starts or ends, and sooner after an error, with an exponential
+ * backoff bounded by the interval.
+ */
+static TimestampTz
+pg_timeout_next_check(TimestampTz now)
+{
+	int64		delay = pg_timeout_check_interval();
+	long		boundary;
+
+	if (worker_consecutive_errors > 0)
+	{
+		int			shift = Min(worker_consecutive_errors - 1, 20);
+
+		delay = Min(delay, (int64) RETRY_MIN_DELAY_MS << shift);
+	}
+
+	boundary = pg_timeout_next_schedule_boundary(now);
+	if (boundary >= 0 && boundary < delay)
+		delay = boundary;
+
+	return TimestampTzPlusMilliseconds(now, delay);
+}
+
+/*
+ * Clean up after an error raised during a check, so that the worker can go
+ * on instead of exiting.  The error is logged and published in the shared
+ * state.
+ */
+static void
+pg_timeout_recover(MemoryContext check_context)
+{
+	ErrorData  *edata;
+
+	MemoryContextSwitchTo(TopMemoryContext);
+	EmitErrorReport();
+	edata = CopyErrorData();
+	FlushErrorState();
+
+	AbortCurrentTransaction();
+	LWLockReleaseAll();
+	pgstat_clear_snapshot();
+	pgstat_report_activity(STATE_IDLE, NULL);
+	MemoryContextReset(check_context);
+
+	worker_consecutive_errors++;
+
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	pgts->errors++;
+	pgts->consecutive_errors = worker_consecutive_errors;
+	pgts->last_error_time = GetCurrentTimestamp();
+	strlcpy(pgts->last_error, edata->message ? edata->message : "",
+			sizeof(pgts->last_error));
+	LWLockRelease(&pgts->lock);
+
+	FreeErrorData(edata);
+}
+
+/*
+ * Forget the worker PID, and free the entry of this cluster in the file of
+ * pg_timeout.host_segment, when the worker exits, whatever the reason.
+ */
+static void
+pg_timeout_worker_exit(int code, Datum arg)
+{
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	if (pgts->worker_pid == MyProcPid)
+		pgts->worker_pid = 0;
+	LWLockRelease(&pgts->lock);
+
+#ifndef WIN32
+	pg_timeout_unmap_host_segment();
+#endif
+}
+
+void
+pg_timeout_worker_main(Datum main_arg)
+{
+	Oid			dboid = DatumGetObjectId(main_arg);
+	MemoryContext check_context;
+	TimestampTz next_check;
+	volatile TimestampTz next_sample;	/* advanced in PG_TRY() */
+	TimestampTz last_check = 0;
+	double		last_check_cpu = 0;
+
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, pg_timeout_sighup);
+	pqsignal(SIGTERM, pg_timeout_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/*
+	 * Connect to our database: the one pg_timeout_launch() was called from,
+	 * or "postgres" for the worker registered at server start.
+	 */
+	if (OidIsValid(dboid))
+		BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+	else
+		BackgroundWorkerInitializeConnection("postgres", NULL, 0);
+
+	/*
+	 * Only one worker may run at a time: the static one registered at
+	 * startup and pg_timeout_launch() could otherwise both be active.
+	 */
+	pg_timeout_attach();
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	if (pgts->worker_pid != 0 && pgts->worker_pid != MyProcPid &&
+		BackendPidGetProc(pgts->worker_pid) != NULL)
+	{
+		pid_t		other_pid = pgts->worker_pid;
+
+		LWLockRelease(&pgts->lock);
+		elog(LOG, "%s: worker already running with PID %d",
+			 MyBgworkerEntry->bgw_name, (int) other_pid);
+		proc_exit(0);
+	}
+	pgts->worker_pid = MyProcPid;
+	pgts->worker_start = GetCurrentTimestamp();
+	pgts->terminated = 0;
+	pgts->errors = 0;
+	pgts->consecutive_errors = 0;
+	pgts->last_error_time = 0;
+	pgts->last_error[0] = '\0';
+	LWLockRelease(&pgts->lock);
+	before_shmem_exit(pg_timeout_worker_exit, (Datum) 0);
+
+	check_context = AllocSetContextCreate(TopMemoryContext,
+										  "pg_timeout check",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	pg_timeout_reload_policy();
+
+	elog(LOG, "%s initialized", MyBgworkerEntry->bgw_name);
+
+	/*
+	 * Main loop: do this until the SIGTERM handler tells us to terminate
+	 */
+
+	next_check = pg_timeout_next_check(GetCurrentTimestamp());
+	next_sample = GetCurrentTimestamp();
+
+	while (!got_sigterm)
+	{
+		int			rc;
+		TimestampTz wakeup;
+		volatile TimestampTz now;
+		volatile int nr = -1;
+		volatile bool failed = false;
+		double		tick_cpu;
+		double		cpu;
+		double		cpu_percent = 0;
+
+		wakeup = next_check;
+		if (worker_policy.sample_interval_ms > 0 && next_sample < wakeup)
+			wakeup = next_sample;
+		if (worker_pending_followed > 0)
+			wakeup = Min(wakeup,
+						 TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													 VERIFY_INTERVAL_MS));
+		if (pg_timeout_draining(GetCurrentTimestamp()))
+			wakeup = Min(wakeup,
+						 TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													 DRAIN_INTERVAL_MS));
+
+		/*
+		 * Background workers mustn't call usleep() or any direct equivalent:
+		 * instead, they may wait on their process latch, which sleeps as
+		 * necessary, but is awakened if postmaster dies.  That way the
+		 * background process goes away immediately in an emergency.
+		 */
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+													   wakeup),
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sigterm)
+			break;
+
+		tick_cpu = pg_timeout_cpu_time();
+
+		/*
+		 * An error must not stop the worker: enforcement would be off until
+		 * the postmaster restarts it.  Errors are reported, the transaction
+		 * is aborted and the check is retried.
+		 */
+		PG_TRY();
+		{
+			bool		reloaded = false;
+
+			/*
+			 * In case of a SIGHUP, just reload the configuration, and apply
+			 * it at once.
+			 */
+			if (got_sighup)
+			{
+				got_sighup = false;
+				ProcessConfigFile(PGC_SIGHUP);
+				pg_timeout_reload_policy();
+				reloaded = true;
+			}
+
+			/*
+			 * Everything allocated by the sampling, the verification of the
+			 * terminations, the drains and the check is released at once.
+			 */
+			MemoryContextSwitchTo(check_context);
+
+			now = GetCurrentTimestamp();
+			if (worker_policy.sample_interval_ms > 0 && now >= next_sample)
+			{
+				/* a sample which fails is skipped, not retried */
+				next_sample = TimestampTzPlusMilliseconds(next_sample,
+														  worker_policy.sample_interval_ms);
+				if (next_sample <= now)
+					next_sample = TimestampTzPlusMilliseconds(now,
+															  worker_policy.sample_interval_ms);
+				pg_timeout_sample(now);
+			}
+
+			pg_timeout_verify_terminations(now);
+			pg_timeout_drain_sessions(now);
+
+			if (now >= next_check || reloaded)
+				nr = pg_timeout_check();
+
+			MemoryContextSwitchTo(TopMemoryContext);
+			MemoryContextReset(check_context);
+		}
+		PG_CATCH();
+		{
+			pg_timeout_recover(check_context);
+			failed = true;
+		}
+		PG_END_TRY();
+
+		if (failed)
+		{
+			next_check = pg_timeout_next_check(GetCurrentTimestamp());
+			continue;
+		}
+
+		/* nothing else to do if only a sample was due */
+		if (nr < 0)
+			continue;
+
+		worker_consecutive_errors = 0;
+		now = GetCurrentTimestamp();
+
+		/*
+		 * The cost of the check, which includes the work done in the same
+		 * tick, drives the interval under pg_timeout.max_cpu_percent.
+		 */
+		cpu = pg_timeout_cpu_time();
+		if (worker_check_cpu_ms < 0)
+			worker_check_cpu_ms = cpu - tick_cpu;
+		else
+			worker_check_cpu_ms += CHECK_CPU_SMOOTHING *
+				(cpu - tick_cpu - worker_check_cpu_ms);
+		if (last_check != 0 && now > last_check)
+			cpu_percent = (cpu - last_check_cpu) * 100.0 /
+				((now - last_check) / 1000.0);
+		last_check = now;
+		last_check_cpu = cpu;
+
+		next_check = pg_timeout_next_check(now);
+
+		LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+		pgts->last_check = now;
+		pgts->check_interval_ms = pg_timeout_check_interval();
+		pgts->check_cpu_ms = worker_check_cpu_ms;
+		pgts->cpu_percent = cpu_percent;
+		pgts->terminated += nr;
+		pgts->consecutive_errors = 0;
+		LWLockRelease(&pgts->lock);
+	}
+
+	/*
+	 * Exit code 0 so that the postmaster does not restart a worker stopped
+	 * on purpose with pg_timeout_stop().
+	 */
+	proc_exit(0);
+}
+
+/*
+ * Fill in the parts of the worker definition shared by the worker
+ * registered at startup and the one started with pg_timeout_launch().
+ */
+static void
+pg_timeout_worker_init(BackgroundWorker *worker)
+{
+	memset(worker, 0, sizeof(BackgroundWorker));
+	worker->bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	/* also on a hot standby, see pg_timeout_resolve_replay_conflicts() */
+	worker->bgw_start_time = BgWorkerStart_ConsistentState;
+	worker->bgw_restart_time = WORKER_RESTART_TIME;
+	sprintf(worker->bgw_library_name, "pg_timeout");
+	sprintf(worker->bgw_function_name, "pg_timeout_worker_main");
+	worker->bgw_notify_pid = 0;
+
+	snprintf(worker->bgw_name, BGW_MAXLEN, "pg_timeout_worker");
+	snprintf(worker->bgw_type, BGW_MAXLEN, "pg_timeout");
+	worker->bgw_main_arg = ObjectIdGetDatum(InvalidOid);
+}
+
+/*
+ * pg_timeout_main()
+ *
+ * SQL function of pg_timeout 1.0, dropped by the update to 1.1.  It is kept
+ * so that 1.0 can still be created, for example by pg_upgrade, and then
+ * updated.
+ */
+Datum
+pg_timeout_main(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_timeout_main() is not supported anymore"),
+			 errhint("Update the extension with ALTER EXTENSION pg_timeout UPDATE, then use pg_timeout_launch().")));
+
+	PG_RETURN_NULL();
+}
+
+/*
+ * pg_timeout_launch()
+ *
+ * Start the worker dynamically in the current database and return its PID.
+ */
+Datum
+pg_timeout_launch(PG_FUNCTION_ARGS)
+{
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	pid_t		pid;
+
+	pg_timeout_attach();
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	pid = pgts->worker_pid;
+	LWLockRelease(&pgts->lock);
+	if (pid != 0 && BackendPidGetProc(pid) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_timeout worker is already running with PID %d",
+						(int) pid)));
+
+	pg_timeout_worker_init(&worker);
+	worker.bgw_notify_pid = MyProcPid;
+	worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not register pg_timeout worker"),
+				 errhint("You may need to increase max_worker_processes.")));
+
+	status = WaitForBackgroundWorkerStartup(handle, &pid);
+	if (status == BGWH_STOPPED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start pg_timeout worker"),
+				 errhint("More details may be available in the server log.")));
+	if (status == BGWH_POSTMASTER_DIED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("cannot start pg_timeout worker without postmaster")));
+	Assert(status == BGWH_STARTED);
+
+	PG_RETURN_INT32(pid);
+}
+
+/*
+ * pg_timeout_stop()
+ *
+ * Ask the running worker to exit.  Return false if there is none.
+ */
+Datum
+pg_timeout_stop(PG_FUNCTION_ARGS)
+{
+	pid_t		pid;
+
+	pg_timeout_attach();
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	pid = pgts->worker_pid;
+	LWLockRelease(&pgts->lock);
+
+	if (pid == 0 || BackendPidGetProc(pid) == NULL)
+		PG_RETURN_BOOL(false);
+
+	if (kill(pid, SIGTERM) != 0)
+		ereport(ERROR,
+				(errmsg("could not send signal to pg_timeout worker %d: %m",
+						(int) pid)));
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * pg_timeout_policy()
+ *
+ * Return the policy currently published by the worker.
+ */
+Datum
+pg_timeout_policy(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5];
+	PgTimeoutPolicy policy;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	pg_timeout_attach();
+	pg_timeout_read_policy(&policy);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) policy.generation);
+	values[1] = TimestampTzGetDatum(policy.published);
+	values[2] = Float8GetDatum(policy.naptime_ms / 1000.0);
+	values[3] = Float8GetDatum(policy.idle_session_timeout_ms / 1000.0);
+	values[4] = CStringGetTextDatum(policy.policy_function);
+	if (policy.generation == 0)
+		nulls[1] = nulls[2] = nulls[3] = nulls[4] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * pg_timeout_status()
+ *
+ * Return the state of the worker, including the last error it has met.
+ */
+Datum
+pg_timeout_status(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[11];
+	bool		nulls[11];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	pg_timeout_attach();
+
+	memset(nulls, 0, sizeof(nulls));
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	values[0] = Int32GetDatum((int32) pgts->worker_pid);
+	values[1] = TimestampTzGetDatum(pgts->worker_start);
+	values[2] = TimestampTzGetDatum(pgts->last_check);
+	values[3] = Int64GetDatum(pgts->terminated);
+	values[4] = Int64GetDatum(pgts->errors);
+	values[5] = Int32GetDatum(pgts->consecutive_errors);
+	values[6] = TimestampTzGetDatum(pgts->last_error_time);
+	values[7] = CStringGetTextDatum(pgts->last_error);
+	values[8] = Float8GetDatum(pgts->check_interval_ms / 1000.0);
+	values[9] = Float8GetDatum(pgts->check_cpu_ms);
+	values[10] = Float8GetDatum(pgts->cpu_percent);
+	nulls[0] = (pgts->worker_pid == 0);
+	nulls[1] = (pgts->worker_start == 0);
+	nulls[2] = (pgts->last_check == 0);
+	nulls[6] = nulls[7] = (pgts->last_error_time == 0);
+	nulls[8] = nulls[9] = nulls[10] = (pgts->last_check == 0);
+	LWLockRelease(&pgts->lock);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Outcome of the terminations: sessions whose slot was released, the
+ * distribution of the time it took in milliseconds, and sessions still
+ * holding their slot.
+ */
+Datum
+pg_timeout_reclaim_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7];
+	PgTimeoutSketch latency;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	pg_timeout_attach();
+
+	memset(nulls, 0, sizeof(nulls));
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	values[0] = Int64GetDatum(pgts->reclaimed);
+	values[1] = Int64GetDatum(pgts->stuck);
+	values[2] = Int32GetDatum(pgts->pending_terminations);
+	latency = pgts->reclaim_latency;
+	LWLockRelease(&pgts->lock);
+
+	if (latency.total > 0)
+	{
+		values[3] = Float8GetDatum(pg_timeout_sketch_quantile(&latency, 0.5));
+		values[4] = Float8GetDatum(pg_timeout_sketch_quantile(&latency, 0.9));
+		values[5] = Float8GetDatum(pg_timeout_sketch_quantile(&latency, 0.99));
+		values[6] = Float8GetDatum(latency.max);
+	}
+	else
+		nulls[3] = nulls[4] = nulls[5] = nulls[6] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Same strings as the state column of pg_stat_activity.
+ */
+static const char *
+pg_timeout_state_name(BackendState state)
+{
+	switch (state)
+	{
+		case STATE_IDLE:
+			return "idle";
+		case STATE_RUNNING:
+			return "active";
+		case STATE_IDLEINTRANSACTION:
+			return "idle in transaction";
+		case STATE_FASTPATH:
+			return "fastpath function call";
+		case STATE_IDLEINTRANSACTION_ABORTED:
+			return "idle in transaction (aborted)";
+		case STATE_DISABLED:
+			return "disabled";
+		case STATE_UNDEFINED:
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Set up a materialized set-returning function call, returning the
+ * tuplestore to fill.
+ */
+static Tuplestorestate *
+pg_timeout_begin_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	return tupstore;
+}
+
+/*
+ * Content of the activity history ring, oldest sample first.
+ */
+Datum
+pg_timeout_activity_history(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = pg_timeout_begin_srf(fcinfo, &tupdesc);
+	PgTimeoutSample *history;
+	PgTimeoutSample *samples;
+	uint64		first;
+	int			nsamples;
+	int			i;
+
+	pg_timeout_attach();
+	history = pg_timeout_history(pgts);
+
+	/* copy the ring so that the lock is not held while building tuples */
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	nsamples = (int) Min(pgts->history_count, (uint64) pgts->history_size);
+	first = pgts->history_count - nsamples;
+	samples = palloc(sizeof(PgTimeoutSample) * Max(nsamples, 1));
+	for (i = 0; i < nsamples; i++)
+		samples[i] = history[(first + i) % pgts->history_size];
+	LWLockRelease(&pgts->lock);
+
+	for (i = 0; i < nsamples; i++)
+	{
+		PgTimeoutSample *s = &samples[i];
+		Datum		values[8];
+		bool		nulls[8];
+		const char *state = pg_timeout_state_name(s->state);
+		const char *wait_event_type = pgstat_get_wait_event_type(s->wait_event_info);
+		const char *wait_event = pgstat_get_wait_event(s->wait_event_info);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = TimestampTzGetDatum(s->sample_time);
+		values[1] = Int32GetDatum(s->pid);
+		values[2] = ObjectIdGetDatum(s->roleid);
+		values[3] = ObjectIdGetDatum(s->dbid);
+		values[4] = state ? CStringGetTextDatum(state) : (Datum) 0;
+		values[5] = wait_event_type ? CStringGetTextDatum(wait_event_type) : (Datum) 0;
+		values[6] = wait_event ? CStringGetTextDatum(wait_event) : (Datum) 0;
+		values[7] = Int64GetDatum(s->query_id);
+		nulls[4] = (state == NULL);
+		nulls[5] = (wait_event_type == NULL);
+		nulls[6] = (wait_event == NULL);
+		nulls[7] = (s->query_id == 0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Cumulative time spent in each state by the client groups.
+ */
+Datum
+pg_timeout_state_times(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = pg_timeout_begin_srf(fcinfo, &tupdesc);
+	PgTimeoutAccount *accounts;
+	int			naccounts;
+	int			i;
+
+	pg_timeout_attach();
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	naccounts = pgts->naccounts;
+	accounts = palloc(sizeof(PgTimeoutAccount) * Max(naccounts, 1));
+	memcpy(accounts, pg_timeout_accounts(pgts),
+		   sizeof(PgTimeoutAccount) * naccounts);
+	LWLockRelease(&pgts->lock);
+
+	for (i = 0; i < naccounts; i++)
+	{
+		PgTimeoutAccount *a = &accounts[i];
+		Datum		values[7];
+		bool		nulls[7];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(a->key.roleid);
+		values[1] = ObjectIdGetDatum(a->key.dbid);
+		values[2] = CStringGetTextDatum(a->key.application_name);
+		values[3] = Int64GetDatum(a->times.sessions);
+		values[4] = Float8GetDatum(a->times.active_time / 1000.0);
+		values[5] = Float8GetDatum(a->times.idle_time / 1000.0);
+		values[6] = Float8GetDatum(a->times.idle_in_xact_time / 1000.0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Pool size and idle timeout advice for each client group, from the
+ * sketches of the number of sessions in use and of the idle periods.
+ *
+ * The pool size is the 99th percentile of the sessions in use plus 25%,
+ * the idle timeout the 99th percentile of the idle periods ending with the
+ * session being used again: a connection idle for longer is unlikely to be
+ * reused before being closed.
+ */
+Datum
+pg_timeout_pool_advice(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = pg_timeout_begin_srf(fcinfo, &tupdesc);
+	PgTimeoutAccount *accounts;
+	int			naccounts;
+	int			i;
+
+	pg_timeout_attach();
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	naccounts = pgts->naccounts;
+	accounts = palloc(sizeof(PgTimeoutAccount) * Max(naccounts, 1));
+	memcpy(accounts, pg_timeout_accounts(pgts),
+		   sizeof(PgTimeoutAccount) * naccounts);
+	LWLockRelease(&pgts->lock);
+
+	for (i = 0; i < naccounts; i++)
+	{
+		PgTimeoutAccount *a = &accounts[i];
+		Datum		values[10];
+		bool		nulls[10];
+		int			p99_active;
+
+		if (a->active.total == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		p99_active = (int) rint(pg_timeout_sketch_quantile(&a->active, 0.99));
+		values[0] = ObjectIdGetDatum(a->key.roleid);
+		values[1] = ObjectIdGetDatum(a->key.dbid);
+		values[2] = CStringGetTextDatum(a->key.application_name);
+		values[3] = Int32GetDatum((int32) a->active.max);
+		values[4] = Int32GetDatum(p99_active);
+		values[8] = Int32GetDatum(Max(1, (int) ceil(p99_active * 1.25)));
+		if (a->idle_gaps.total > 0)
+		{
+			double		p99_gap = pg_timeout_sketch_quantile(&a->idle_gaps, 0.99);
+
+			values[5] = Float8GetDatum(pg_timeout_sketch_quantile(&a->idle_gaps, 0.5) / 1000.0);
+			values[6] = Float8GetDatum(pg_timeout_sketch_quantile(&a->idle_gaps, 0.9) / 1000.0);
+			values[7] = Float8GetDatum(p99_gap / 1000.0);
+			values[9] = Float8GetDatum(Max(1.0, ceil(p99_gap / 1000.0)));
+		}
+		else
+			nulls[5] = nulls[6] = nulls[7] = nulls[9] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Number of client sessions in a database, other than ours.  Autovacuum and
+ * other background processes are not counted: they are not drained.
+ */
+static int
+pg_timeout_count_clients(Oid dbid)
+{
+	int			nbackends;
+	int			nclients = 0;
+	int			i;
+
+	pgstat_clear_snapshot();
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+
+		if (local == NULL)
+			continue;
+		be = &local->backendStatus;
+		if (be->st_backendType == B_BACKEND &&
+			be->st_procpid > 0 &&
+			be->st_procpid != MyProcPid &&
+			be->st_databaseid == dbid)
+			nclients++;
+	}
+
+	return nclients;
+}
+
+/*
+ * Drain a database before a maintenance: its idle sessions are terminated
+ * by the worker at once, and the other ones as soon as they are idle, until
+ * none is left or the deadline is reached.  Returns the sessions still
+ * connected at the end.
+ */
+Datum
+pg_timeout_drain(PG_FUNCTION_ARGS)
+{
+	Name		dbname = PG_GETARG_NAME(0);
+	TimestampTz deadline = PG_GETARG_TIMESTAMPTZ(1);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = pg_timeout_begin_srf(fcinfo, &tupdesc);
+	Oid			dbid = get_database_oid(NameStr(*dbname), false);
+	PGPROC	   *worker = NULL;
+	int			slot = -1;
+	int			nbackends;
+	int			i;
+
+	if (deadline <= GetCurrentTimestamp())
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("drain deadline must be in the future")));
+
+	pg_timeout_attach();
+
+	LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+	if (pgts->worker_pid != 0)
+		worker = BackendPidGetProc(pgts->worker_pid);
+	for (i = 0; i < MAX_DRAINS && worker != NULL; i++)
+	{
+		if (!OidIsValid(pgts->drains[i].dbid))
+		{
+			slot = i;
+			pgts->drains[i].dbid = dbid;
+			pgts->drains[i].requester = MyProcPid;
+			pgts->drains[i].deadline = deadline;
+			pgts->drains[i].terminated = 0;
+			break;
+		}
+	}
+	LWLockRelease(&pgts->lock);
+
+	if (worker == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_timeout worker is not running")));
+	if (slot < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("too many databases being drained"),
+				 errdetail("At most %d databases can be drained at the same time.",
+						   MAX_DRAINS)));
+
+	SetLatch(&worker->procLatch);
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			if (pg_timeout_count_clients(dbid) == 0 ||
+				GetCurrentTimestamp() >= deadline)
+				break;
+
+			(void) WaitLatch(MyLatch,
+							 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 100L,
+							 PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+	PG_FINALLY();
+	{
+		LWLockAcquire(&pgts->lock, LW_EXCLUSIVE);
+		pgts->drains[slot].dbid = InvalidOid;
+		LWLockRelease(&pgts->lock);
+	}
+	PG_END_TRY();
+
+	/* what is left */
+	pgstat_clear_snapshot();
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		LocalPgBackendStatus *local = pg_timeout_fetch_beentry(i);
+		PgBackendStatus *be;
+		Datum		values[6];
+		bool		nulls[6];
+		const char *state;
+		char	   *usename_val;
+
+		if (local == NULL)
+			continue;
+		be = &local->backendStatus;
+		if (be->st_backendType != B_BACKEND ||
+			be->st_procpid <= 0 ||
+			be->st_procpid == MyProcPid ||
+			be->st_databaseid != dbid)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		state = pg_timeout_state_name(be->st_state);
+		usename_val = GetUserNameFromId(be->st_userid, true);
+		values[0] = Int32GetDatum(be->st_procpid);
+		values[1] = usename_val ? CStringGetTextDatum(usename_val) : (Datum) 0;
+		values[2] = CStringGetTextDatum(be->st_appname ? be->st_appname : "");
+		values[3] = state ? CStringGetTextDatum(state) : (Datum) 0;
+		values[4] = TimestampTzGetDatum(be->st_state_start_timestamp);
+		values[5] = CStringGetTextDatum(be->st_activity_raw ?
+										pgstat_clip_activity(be->st_activity_raw) : "");
+		nulls[1] = (usename_val == NULL);
+		nulls[3] = (state == NULL);
+		nulls[4] = (be->st_state_start_timestamp == 0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Counts of the sessions selected by the live decision and
+ * pg_timeout.shadow_policies, and the last sessions on which they differ.
+ */
+Datum
+pg_timeout_shadow_report(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = pg_timeout_begin_srf(fcinfo, &tupdesc);
+	PgTimeoutShadowDiff *diffs;
+	uint64		first;
+	int			ndiffs;
+	int			i;
+
+	pg_timeout_attach();
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	ndiffs = (int) Min(pgts->shadow_count, (uint64) MAX_SHADOW_DIFFS);
+	first = pgts->shadow_count - ndiffs;
+	diffs = palloc(sizeof(PgTimeoutShadowDiff) * Max(ndiffs, 1));
+	for (i = 0; i < ndiffs; i++)
+		diffs[i] = pgts->shadow_diffs[(first + i) % MAX_SHADOW_DIFFS];
+	LWLockRelease(&pgts->lock);
+
+	for (i = 0; i < ndiffs; i++)
+	{
+		PgTimeoutShadowDiff *d = &diffs[i];
+		Datum		values[9];
+		bool		nulls[9];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = TimestampTzGetDatum(d->time);
+		values[1] = Int32GetDatum(d->pid);
+		values[2] = ObjectIdGetDatum(d->roleid);
+		values[3] = ObjectIdGetDatum(d->dbid);
+		values[4] = CStringGetTextDatum(d->application_name);
+		values[5] = Float8GetDatum(d->idle_ms / 1000.0);
+		values[6] = Float8GetDatum(d->live_timeout_ms / 1000.0);
+		values[7] = Float8GetDatum(d->shadow_timeout_ms / 1000.0);
+		values[8] = CStringGetTextDatum(d->shadow_terminate ? "shadow_only" : "live_only");
+		nulls[6] = (d->live_timeout_ms < 0);
+		nulls[7] = (d->shadow_timeout_ms < 0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+Datum
+pg_timeout_shadow_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	pg_timeout_attach();
+
+	memset(nulls, 0, sizeof(nulls));
+
+	LWLockAcquire(&pgts->lock, LW_SHARED);
+	values[0] = Int64GetDatum(pgts->shadow_both);
+	values[1] = Int64GetDatum(pgts->shadow_only);
+	values[2] = Int64GetDatum(pgts->live_only);
+	LWLockRelease(&pgts->lock);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Clusters registered in the file of pg_timeout.host_segment, with the idle
+ * sessions and idle memory they have published.  The file is read without
+ * the lock, so entries being written may be inconsistent.
+ */
+Datum
+pg_timeout_host_status(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = pg_timeout_begin_srf(fcinfo, &tupdesc);
+	PgTimeoutHostSegment *host;
+	int			fd;
+	int			i;
+
+	if (pg_timeout_host_segment == NULL || pg_timeout_host_segment[0] == '\0')
+		return (Datum) 0;
+
+	fd = OpenTransientFile(pg_timeout_host_segment, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return (Datum) 0;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m",
+						pg_timeout_host_segment)));
+	}
+
+	host = palloc0(sizeof(PgTimeoutHostSegment));
+	if (read(fd, host, sizeof(PgTimeoutHostSegment)) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m",
+						pg_timeout_host_segment)));
+	CloseTransientFile(fd);
+
+	if (host->magic != HOST_SEGMENT_MAGIC ||
+		host->version != HOST_SEGMENT_VERSION)
+		return (Datum) 0;
+
+	for (i = 0; i < MAX_HOST_CLUSTERS; i++)
+	{
+		PgTimeoutHostSlot *slot = &host->slots[i];
+		Datum		values[7];
+		bool		nulls[7];
+
+		if (slot->postmaster_pid == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(slot->postmaster_pid);
+		values[1] = CStringGetTextDatum(slot->data_directory);
+		values[2] = TimestampTzGetDatum(slot->updated);
+		values[3] = Int32GetDatum(slot->idle_sessions);
+		values[4] = Int64GetDatum(slot->idle_memory_kb);
+		values[5] = Int64GetDatum(slot->evicting_kb);
+		values[6] = BoolGetDatum(slot->postmaster_pid == PostmasterPid);
+		nulls[2] = (slot->updated == 0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Entrypoint of this module.
+ *
+ */
+void
+_PG_init(void)
+{
+	BackgroundWorker worker;
+
+	/* get the configuration */
+	DefineCustomRealVariable("pg_timeout.naptime",
+							 "Duration between each check.",
+							 "In seconds if no unit is given, with millisecond precision.",
+							 &pg_timeout_naptime,
+							 10.0,
+							 0.001,
+							 INT_MAX / 1000,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.min_naptime",
+							 "Shortest duration between each check under pg_timeout.max_cpu_percent.",
+							 "In seconds if no unit is given, with millisecond precision.",
+							 &pg_timeout_min_naptime,
+							 1.0,
+							 0.001,
+							 INT_MAX / 1000,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.max_cpu_percent",
+							 "Percentage of a CPU the checks may use, the interval adapting between pg_timeout.min_naptime and pg_timeout.naptime.",
+							 "0 checks every pg_timeout.naptime.",
+							 &pg_timeout_max_cpu_percent,
+							 0,
+							 0,
+							 100,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.idle_session_timeout",
+							 "Maximum idle session time.",
+							 "In seconds if no unit is given, with millisecond precision.",
+							 &pg_timeout_idle_session_timeout,
+							 60.0,
+							 0.001,
+							 INT_MAX,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_timeout.policy_function",
+							   "SQL function deciding which idle sessions to terminate.",
+							   "Called once per check with an array of pg_timeout_candidate, "
+							   "returns the PIDs to terminate. Empty to use pg_timeout.idle_session_timeout.",
+							   &pg_timeout_policy_function,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_policy_function,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_timeout.pressure_threshold",
+							"Percentage of max_connections above which idle sessions are evicted before their timeout.",
+							"0 disables eviction under pressure.",
+							&pg_timeout_pressure_threshold,
+							0,
+							0,
+							100,
+							PGC_SIGHUP,
+							0,
+							NULL,
 							NULL,
 							NULL);
 
-	if (!process_shared_preload_libraries_in_progress)
-		return;
+	DefineCustomRealVariable("pg_timeout.pressure_min_idle",
+							 "Minimum idle time of a session evicted under pressure.",
+							 NULL,
+							 &pg_timeout_pressure_min_idle,
+							 10.0,
+							 0.0,
+							 INT_MAX,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.score_idle_weight",
+							 "Eviction score weight of each idle minute.",
+							 NULL,
+							 &pg_timeout_score_idle_weight,
+							 1.0,
+							 0.0,
+							 1000000.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.score_memory_weight",
+							 "Eviction score weight of each MB of backend memory.",
+							 "0 avoids reading backend memory usage.",
+							 &pg_timeout_score_memory_weight,
+							 1.0,
+							 0.0,
+							 1000000.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.score_age_weight",
+							 "Eviction cost weight of each hour of session age.",
+							 NULL,
+							 &pg_timeout_score_age_weight,
+							 1.0,
+							 0.0,
+							 1000000.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
 
-	DefineCustomIntVariable("pg_timeout.idle_session_timeout",
-							"Maximum idle session time.",
+	DefineCustomRealVariable("pg_timeout.score_reconnect_weight",
+							 "Eviction cost weight of each new connection per minute of the client group.",
+							 NULL,
+							 &pg_timeout_score_reconnect_weight,
+							 1.0,
+							 0.0,
+							 1000000.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_timeout.max_idle_per_role",
+							"Maximum number of idle sessions of each role.",
+							"0 disables the quota.",
+							&pg_timeout_max_idle_per_role,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
 							NULL,
-							&pg_timeout_idle_session_timeout,
-							60,
-							1,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_timeout.max_idle_per_database",
+							"Maximum number of idle sessions in each database.",
+							"0 disables the quota.",
+							&pg_timeout_max_idle_per_database,
+							0,
+							0,
 							INT_MAX,
 							PGC_SIGHUP,
 							0,
@@ -318,30 +5875,254 @@ _PG_init(void)
 							NULL,
 							NULL);
 
-	/* set up common data for all our workers */
-	memset(&worker, 0, sizeof(worker));
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
-		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-	worker.bgw_restart_time = pg_timeout_naptime;
-	sprintf(worker.bgw_library_name, "pg_timeout");
-	sprintf(worker.bgw_function_name, "pg_timeout_main");
-	worker.bgw_notify_pid = 0;
-
-	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_timeout_worker");
-#if PG_VERSION_NUM >= 110000
-	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_timeout");
+	DefineCustomRealVariable("pg_timeout.warning_time",
+							 "Time before the idle session timeout at which the session is notified on channel pg_timeout.",
+							 "0 disables notifications.",
+							 &pg_timeout_warning_time,
+							 0.0,
+							 0.0,
+							 INT_MAX,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_timeout.schedule",
+							   "Idle session timeouts by day of week and time of day.",
+							   "Semicolon-separated entries such as \"mon-fri 08:00-18:00 role=bi 15min\". "
+							   "The first active entry matching the role applies.",
+							   &pg_timeout_schedule,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_schedule,
+							   pg_timeout_assign_schedule,
+							   NULL);
+
+	DefineCustomStringVariable("pg_timeout.schedule_timezone",
+							   "Time zone of pg_timeout.schedule.",
+							   "Empty to use the server time zone.",
+							   &pg_timeout_schedule_timezone,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_timezone,
+							   NULL,
+							   NULL);
+
+	DefineCustomRealVariable("pg_timeout.sample_interval",
+							 "Duration between each sample of the activity history.",
+							 "In seconds if no unit is given, with millisecond precision. 0 disables sampling.",
+							 &pg_timeout_sample_interval,
+							 0.0,
+							 0.0,
+							 INT_MAX / 1000,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_timeout.exemptions",
+							   "Idle sessions exempted from the idle session timeout.",
+							   "Comma-separated list of listen, advisory_lock and temp_table.",
+							   &pg_timeout_exemptions,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   pg_timeout_check_exemptions,
+							   pg_timeout_assign_exemptions,
+							   NULL);
+
+	DefineCustomRealVariable("pg_timeout.exempt_idle_session_timeout",
+							 "Maximum idle session time of the sessions exempted by pg_timeout.exemptions.",
+							 "In seconds if no unit is given, with millisecond precision. 0 never terminates them.",
+							 &pg_timeout_exempt_idle_session_timeout,
+							 0.0,
+							 0.0,
+							 INT_MAX,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_timeout.terminate_timeout",
+							 "Time after which a terminated session still running is reported.",
+							 "In seconds if no unit is given, with millisecond precision. 0 disables the report.",
+							 &pg_timeout_terminate_timeout,
+							 10.0,
+							 0.0,
+							 INT_MAX,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_timeout.pressure_selection",
+							 "How idle sessions are selected under connection pressure.",
+							 "score selects the best scores, fair_share spreads the selection over roles and databases.",
+							 &pg_timeout_pressure_selection,
+							 PRESSURE_SELECTION_SCORE,
+							 pressure_selection_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_timeout.tenant_priorities",
+							   "Priorities of roles and databases for the fair-share selection.",
+							   "Semicolon-separated list of entries such as \"role=bi 0.5\" or \"database=shop 2\".",
+							   &pg_timeout_tenant_priorities,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_tenant_priorities,
+							   pg_timeout_assign_tenant_priorities,
+							   NULL);
+
+	DefineCustomRealVariable("pg_timeout.standby_lag_threshold",
+							 "Replay lag of a standby above which sessions holding a snapshot are terminated.",
+							 "In seconds if no unit is given, with millisecond precision. 0 disables it.",
+							 &pg_timeout_standby_lag_threshold,
+							 0.0,
+							 0.0,
+							 INT_MAX,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_timeout.temp_files_threshold",
+							"Size of temporary files above which idle and idle in transaction sessions are terminated first.",
+							"0 disables it.",
+							&pg_timeout_temp_files_threshold,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_timeout.host_segment",
+							   "File shared with the pg_timeout workers of the other clusters of the host.",
+							   "Empty disables the coordination.",
+							   &pg_timeout_host_segment,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_host_segment,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_timeout.host_memory_threshold",
+							"Percentage of the host memory in use above which idle sessions are terminated, in coordination with the other clusters.",
+							"0 disables it.",
+							&pg_timeout_host_memory_threshold,
+							0,
+							0,
+							100,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_timeout.policies",
+							   "Idle session timeouts by role, database, application or client network.",
+							   "Semicolon-separated list of entries such as \"role=bi:1h\", \"app=psql*:10m\", "
+							   "\"cidr=10.1.0.0/16:exempt\" or \"default:60s\"; the first matching entry applies.",
+							   &pg_timeout_policies,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_policies,
+							   pg_timeout_assign_policies,
+							   NULL);
+
+	DefineCustomStringVariable("pg_timeout.shadow_policies",
+							   "Candidate value of pg_timeout.policies, evaluated at each check without terminating sessions.",
+							   "Same syntax as pg_timeout.policies. Empty disables the evaluation.",
+							   &pg_timeout_shadow_policies,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   pg_timeout_check_policies,
+							   pg_timeout_assign_shadow_policies,
+							   NULL);
+
+	/*
+	 * The size of the shared state can only be set when it is allocated at
+	 * server start; PGC_POSTMASTER variables cannot be defined later.  A
+	 * segment created on first use gets the default size.
+	 */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		DefineCustomIntVariable("pg_timeout.history_size",
+								"Number of samples kept in the activity history.",
+								NULL,
+								&pg_timeout_history_size,
+								10000,
+								0,
+								INT_MAX / 1024,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("pg_timeout.max_accounts",
+								"Maximum number of client groups with state time accounting.",
+								"A client group is a user, database and application name. 0 disables the accounting.",
+								&pg_timeout_max_accounts,
+								1000,
+								0,
+								INT_MAX / 1024,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+	}
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("pg_timeout");
+#endif
+
+	/*
+	 * Without shared_preload_libraries the worker is started on demand with
+	 * pg_timeout_launch().
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM < 170000
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pg_timeout_shmem_request;
+#else
+	RequestAddinShmemSpace(pg_timeout_shmem_size());
 #endif
-	worker.bgw_main_arg = 0;
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pg_timeout_shmem_startup;
+#endif
+
+	/* set up common data for all our workers */
+	pg_timeout_worker_init(&worker);
 
 	RegisterBackgroundWorker(&worker);
 
-	elog(LOG, "%s started with pg_timeout.naptime=%d seconds", 
+	elog(LOG, "%s started with pg_timeout.naptime=%g seconds",
                   worker.bgw_name,
                   pg_timeout_naptime);
 
-	elog(LOG, "%s started with pg_timeout.idle_session_timeout=%d seconds", 
+	elog(LOG, "%s started with pg_timeout.idle_session_timeout=%g seconds",
                   worker.bgw_name,
                   pg_timeout_idle_session_timeout);
 }
-
@@ -0,0 +1,81 @@
+/* -------------------------------------------------------------------------
+ *
+ * pg_timeout.h
+ *
+ * Hooks exported by pg_timeout to other extensions.
+ *
+ * An extension using them must be listed in shared_preload_libraries
+ * after pg_timeout so that the hooks are set in the pg_timeout worker.
+ * Include it with:
+ *
+ *     #include "extension/pg_timeout/pg_timeout.h"
+ *
+ * Copyright 2020 Pierre Forstmann
+ * -------------------------------------------------------------------------
+ */
+#ifndef PG_TIMEOUT_H
+#define PG_TIMEOUT_H
+
+#include "datatype/timestamp.h"
+#include "libpq/pqcomm.h"
+#include "utils/backend_status.h"
+
+/*
+ * One idle client session seen by the worker during a check.
+ *
+ * All idle sessions are passed to the hooks, not only the ones which have
+ * reached the timeout: terminate is preset by pg_timeout and may be changed
+ * by pg_timeout_candidate_hook.  Exempted sessions are passed too, with
+ * their exempt flags, and a timeout_ms of -1 when they are kept without
+ * pg_timeout.exempt_idle_session_timeout.  Sessions to terminate are
+ * processed by decreasing priority, which defaults to the idle time in
+ * seconds.
+ */
+typedef struct PgTimeoutCandidate
+{
+	int			pid;
+	Oid			roleid;
+	Oid			dbid;
+	BackendState state;
+	TimestampTz state_change;
+	TimestampTz backend_start;
+	TimestampTz xact_start;
+	SockAddr	client_addr;
+	char		application_name[NAMEDATALEN];
+	char		client_hostname[NAMEDATALEN];
+	int64		idle_ms;		/* time spent in the current state */
+	int64		timeout_ms;		/* idle timeout applying to the session, or -1 */
+	int			exempt;			/* PG_TIMEOUT_EXEMPT_* flags */
+	int64		memory_kb;		/* anonymous memory, only read under pressure */
+	double		reconnect_rate; /* new connections per minute of the group */
+	double		score;			/* eviction score under pressure */
+	bool		terminate;		/* session will be terminated */
+	double		priority;		/* termination order, highest first */
+	char		reason[64];		/* logged with the termination */
+} PgTimeoutCandidate;
+
+/*
+ * Reasons for a session to be exempted from the idle session timeout, see
+ * pg_timeout.exemptions and pg_timeout.policies.
+ */
+#define PG_TIMEOUT_EXEMPT_LISTEN		0x01	/* last statement was LISTEN */
+#define PG_TIMEOUT_EXEMPT_ADVISORY_LOCK	0x02	/* holds an advisory lock */
+#define PG_TIMEOUT_EXEMPT_TEMP_TABLE	0x04	/* has used temporary tables */
+#define PG_TIMEOUT_EXEMPT_POLICY		0x08	/* exempt in pg_timeout.policies */
+
+/*
+ * Called once per check with the whole batch of candidates.
+ */
+typedef void (*pg_timeout_candidate_hook_type) (PgTimeoutCandidate *candidates,
+												int ncandidates);
+
+/*
+ * Called once per check with the sessions which have been signalled.
+ */
+typedef void (*pg_timeout_terminated_hook_type) (const PgTimeoutCandidate *terminated,
+												 int nterminated);
+
+extern PGDLLIMPORT pg_timeout_candidate_hook_type pg_timeout_candidate_hook;
+extern PGDLLIMPORT pg_timeout_terminated_hook_type pg_timeout_terminated_hook;
+
+#endif							/* PG_TIMEOUT_H */
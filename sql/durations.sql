@@ -0,0 +1,14 @@
+--
+-- Durations are in seconds if no unit is given, with millisecond precision
+--
+LOAD 'pg_timeout';
+ALTER SYSTEM SET pg_timeout.naptime = 0.25;
+ALTER SYSTEM SET pg_timeout.naptime = '200ms';
+ALTER SYSTEM SET pg_timeout.idle_session_timeout = '1.5min';
+ALTER SYSTEM SET pg_timeout.pressure_min_idle = '2s';
+ALTER SYSTEM SET pg_timeout.warning_time = 5;
+ALTER SYSTEM SET pg_timeout.naptime = '10 parsecs';
+ALTER SYSTEM RESET pg_timeout.naptime;
+ALTER SYSTEM RESET pg_timeout.idle_session_timeout;
+ALTER SYSTEM RESET pg_timeout.pressure_min_idle;
+ALTER SYSTEM RESET pg_timeout.warning_time;
@@ -0,0 +1,20 @@
+--
+-- Check hook of pg_timeout.policies and pg_timeout.shadow_policies
+--
+LOAD 'pg_timeout';
+-- valid values
+ALTER SYSTEM SET pg_timeout.policies = 'role=bi:1h; app=psql*:10m; cidr=10.1.0.0/16:exempt; default:60s';
+ALTER SYSTEM SET pg_timeout.policies = 'db=app:1.5; cidr=2001:db8::/32:10min; app=*:500ms';
+ALTER SYSTEM SET pg_timeout.policies = ' ; default : 2 m ; ';
+ALTER SYSTEM SET pg_timeout.shadow_policies = 'app=psql*:10m; default:2min';
+-- invalid values
+ALTER SYSTEM SET pg_timeout.policies = 'role=bi';
+ALTER SYSTEM SET pg_timeout.policies = 'user=bi:1h';
+ALTER SYSTEM SET pg_timeout.policies = 'role=:1h';
+ALTER SYSTEM SET pg_timeout.policies = 'cidr=host.example:1h';
+ALTER SYSTEM SET pg_timeout.policies = 'default:10x';
+ALTER SYSTEM SET pg_timeout.policies = 'default:10mm';
+ALTER SYSTEM SET pg_timeout.policies = 'default:0';
+ALTER SYSTEM SET pg_timeout.shadow_policies = 'default';
+ALTER SYSTEM RESET pg_timeout.policies;
+ALTER SYSTEM RESET pg_timeout.shadow_policies;
@@ -0,0 +1,68 @@
+--
+-- Privileges on the functions and views: PUBLIC, pg_read_all_stats or
+-- superusers only
+--
+CREATE EXTENSION pg_timeout;
+-- launching and stopping the worker is for superusers
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_launch()'), ('pg_timeout_stop()')) AS v(o);
+-- the policy is readable by all
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_policy()')) AS v(o);
+-- the worker status is for pg_read_all_stats
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_status()')) AS v(o);
+-- the activity history is for pg_read_all_stats
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_activity_history()')) AS v(o);
+SELECT o AS view,
+	   has_table_privilege('public', o, 'SELECT') AS public,
+	   has_table_privilege('pg_read_all_stats', o, 'SELECT') AS read_all_stats
+FROM (VALUES ('pg_timeout_activity_history')) AS v(o);
+-- state times are for pg_read_all_stats
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_state_times()')) AS v(o);
+SELECT o AS view,
+	   has_table_privilege('public', o, 'SELECT') AS public,
+	   has_table_privilege('pg_read_all_stats', o, 'SELECT') AS read_all_stats
+FROM (VALUES ('pg_timeout_state_times')) AS v(o);
+-- pool advice is for pg_read_all_stats
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_pool_advice()')) AS v(o);
+-- reclaim statistics are readable by all
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_reclaim_stats()')) AS v(o);
+-- draining a database is for superusers
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_drain(name, timestamptz)')) AS v(o);
+-- shadow statistics are readable by all, the report is for pg_read_all_stats
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_shadow_stats()'), ('pg_timeout_shadow_report()')) AS v(o);
+SELECT o AS view,
+	   has_table_privilege('public', o, 'SELECT') AS public,
+	   has_table_privilege('pg_read_all_stats', o, 'SELECT') AS read_all_stats
+FROM (VALUES ('pg_timeout_shadow_report')) AS v(o);
+-- the host status is for superusers
+SELECT o AS function,
+	   has_function_privilege('public', o, 'EXECUTE') AS public,
+	   has_function_privilege('pg_read_all_stats', o, 'EXECUTE') AS read_all_stats
+FROM (VALUES ('pg_timeout_host_status()')) AS v(o);
+DROP EXTENSION pg_timeout;
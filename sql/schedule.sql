@@ -0,0 +1,20 @@
+--
+-- Check hooks of pg_timeout.schedule and pg_timeout.schedule_timezone
+--
+LOAD 'pg_timeout';
+-- valid values
+ALTER SYSTEM SET pg_timeout.schedule = 'mon-fri 08:00-19:00 role=bi 15min; * 19:00-08:00 role=bi 2m; sat,sun 00:00-24:00 90';
+ALTER SYSTEM SET pg_timeout.schedule = 'fri-mon 22:00-06:00 500ms;';
+ALTER SYSTEM SET pg_timeout.schedule_timezone = 'Europe/Paris';
+-- invalid values
+ALTER SYSTEM SET pg_timeout.schedule = 'mon-fri 08:00-19:00';
+ALTER SYSTEM SET pg_timeout.schedule = 'mon-fri 08:00-19:00 role=bi 15min 1h';
+ALTER SYSTEM SET pg_timeout.schedule = 'mon-xyz 08:00-19:00 15min';
+ALTER SYSTEM SET pg_timeout.schedule = 'mon 08:00 15min';
+ALTER SYSTEM SET pg_timeout.schedule = 'mon 08:00-24:30 15min';
+ALTER SYSTEM SET pg_timeout.schedule = 'mon 24:00-08:00 15min';
+ALTER SYSTEM SET pg_timeout.schedule = 'mon 08:00-19:00 user=bi 15min';
+ALTER SYSTEM SET pg_timeout.schedule = '* 08:00-19:00 15min; mon 08:00-19:00 0';
+ALTER SYSTEM SET pg_timeout.schedule_timezone = 'Mars/Olympus_Mons';
+ALTER SYSTEM RESET pg_timeout.schedule;
+ALTER SYSTEM RESET pg_timeout.schedule_timezone;
@@ -0,0 +1,19 @@
+--
+-- Settings of the fair-share selection
+--
+LOAD 'pg_timeout';
+-- valid values
+ALTER SYSTEM SET pg_timeout.pressure_selection = 'fair_share';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi 0.5; database=shop 2;';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = '  role=etl  1e-3  ';
+-- invalid values
+ALTER SYSTEM SET pg_timeout.pressure_selection = 'random';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi 0.5 1';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi 1; user=etl 2';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'database= 2';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi 0';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi -1';
+ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bi high';
+ALTER SYSTEM RESET pg_timeout.pressure_selection;
+ALTER SYSTEM RESET pg_timeout.tenant_priorities;
@@ -0,0 +1,23 @@
+--
+-- Update from 1.0, compared with a new installation of 1.1
+--
+CREATE TEMP VIEW members AS
+	SELECT pg_describe_object(d.classid, d.objid, d.objsubid) AS object,
+		   coalesce(p.proacl, c.relacl)::text AS acl
+	FROM pg_depend d
+	LEFT JOIN pg_proc p ON d.classid = 'pg_proc'::regclass AND p.oid = d.objid
+	LEFT JOIN pg_class c ON d.classid = 'pg_class'::regclass AND c.oid = d.objid
+	WHERE d.refclassid = 'pg_extension'::regclass AND d.deptype = 'e'
+	  AND d.refobjid = (SELECT oid FROM pg_extension WHERE extname = 'pg_timeout');
+CREATE EXTENSION pg_timeout VERSION '1.0';
+SELECT pg_timeout_main();
+ALTER EXTENSION pg_timeout UPDATE TO '1.1';
+CREATE TEMP TABLE updated AS SELECT * FROM members;
+DROP EXTENSION pg_timeout;
+CREATE EXTENSION pg_timeout;
+SELECT count(*) FROM members;
+-- same objects and privileges
+(SELECT * FROM updated EXCEPT SELECT * FROM members)
+UNION ALL
+(SELECT * FROM members EXCEPT SELECT * FROM updated);
+DROP EXTENSION pg_timeout;
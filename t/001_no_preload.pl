@@ -0,0 +1,59 @@
+# pg_timeout without shared_preload_libraries
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('no_preload');
+$node->init;
+$node->start;
+
+# the library defines its settings when loaded, except the sizes of the
+# shared state
+is( $node->safe_psql(
+		'postgres', q{
+LOAD 'pg_timeout';
+SELECT current_setting('pg_timeout.naptime'),
+	   count(*) FILTER (WHERE name IN ('pg_timeout.history_size',
+									   'pg_timeout.max_accounts'))
+FROM pg_settings}),
+	'10s|0',
+	'LOAD without shared_preload_libraries');
+
+$node->safe_psql('postgres', 'CREATE EXTENSION pg_timeout');
+pass('CREATE EXTENSION without shared_preload_libraries');
+
+if ($node->pg_version >= 17)
+{
+	my $pid = $node->safe_psql('postgres', 'SELECT pg_timeout_launch()');
+	ok($pid > 0, 'worker launched');
+	ok( $node->poll_query_until(
+			'postgres',
+			"SELECT count(*) = 1 FROM pg_stat_activity WHERE pid = $pid"),
+		'worker running');
+	is( $node->safe_psql(
+			'postgres', 'SELECT count(*) >= 0 FROM pg_timeout_activity_history()'),
+		't',
+		'activity history of the default size');
+	is( $node->safe_psql(
+			'postgres', 'SELECT count(*) >= 0 FROM pg_timeout_state_times()'),
+		't',
+		'state time accounting of the default size');
+	is($node->safe_psql('postgres', 'SELECT pg_timeout_stop()'),
+		't', 'worker stopped');
+}
+else
+{
+	my ($ret, $stdout, $stderr) =
+	  $node->psql('postgres', 'SELECT pg_timeout_launch()');
+	like(
+		$stderr,
+		qr/must be loaded via shared_preload_libraries/,
+		'worker needs shared_preload_libraries before PostgreSQL 17');
+}
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,110 @@
+# pg_timeout.policy_function choosing the idle sessions to terminate
+use strict;
+use warnings;
+
+use IPC::Run;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('policy_function');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'pg_timeout'
+pg_timeout.naptime = '100ms'
+pg_timeout.idle_session_timeout = '1h'
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION pg_timeout');
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_timeout'"
+) or die 'worker not started';
+
+my @sessions;
+
+# open an idle session, which stays until its backend is terminated
+sub idle_session
+{
+	my ($app) = @_;
+	my $stdin = '';
+	my $output = '';
+
+	push @sessions,
+	  IPC::Run::start(
+		[
+			'psql', '-XAtq', '-d',
+			$node->connstr('postgres') . " application_name=$app"
+		],
+		'<', \$stdin, '>', \$output, '2>', \$output);
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = 1 FROM pg_stat_activity WHERE application_name = '$app' AND state = 'idle'"
+	) or die "session $app not idle";
+}
+
+# change settings and wait for the worker to apply them
+sub reconfigure
+{
+	my ($sql) = @_;
+	my $generation = $node->safe_psql('postgres',
+		'SELECT generation FROM pg_timeout_policy()');
+
+	$node->safe_psql('postgres', "$sql\nSELECT pg_reload_conf();");
+	$node->poll_query_until('postgres',
+		"SELECT generation > $generation FROM pg_timeout_policy()")
+	  or die 'configuration not applied';
+}
+
+# wait for two checks to complete from now
+sub wait_checks
+{
+	foreach (1 .. 2)
+	{
+		my $now = $node->safe_psql('postgres', 'SELECT now()');
+		$node->poll_query_until('postgres',
+			"SELECT last_check > '$now' FROM pg_timeout_status()")
+		  or die 'no check done';
+	}
+}
+
+sub remaining
+{
+	return $node->safe_psql('postgres',
+		"SELECT string_agg(application_name, ',' ORDER BY application_name) FROM pg_stat_activity WHERE application_name ~ '^(victim|keeper)'"
+	);
+}
+
+$node->safe_psql(
+	'postgres', q{
+CREATE FUNCTION kill_victims(c pg_timeout_candidate[]) RETURNS integer[]
+LANGUAGE sql AS $$
+  SELECT array_agg(pid) FROM unnest(c) WHERE app LIKE 'victim%'
+$$;
+});
+
+idle_session($_) foreach qw(victim1 keeper1 victim2 keeper2);
+
+reconfigure(
+	"ALTER SYSTEM SET pg_timeout.policy_function = 'kill_victims';");
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE application_name LIKE 'victim%'"
+	),
+	'sessions selected by the policy function terminated');
+is(remaining(), 'keeper1,keeper2', 'other sessions kept');
+like(
+	slurp_file($node->logfile),
+	qr/application=victim1 hostname=\S+ reason=policy_function/,
+	'termination logged with its reason');
+
+# the function replaces the timeout: sessions over it are not terminated
+reconfigure("ALTER SYSTEM SET pg_timeout.idle_session_timeout = '1ms';");
+wait_checks();
+is(remaining(), 'keeper1,keeper2',
+	'sessions over pg_timeout.idle_session_timeout kept');
+
+$_->kill_kill foreach @sessions;
+$node->stop;
+
+done_testing();
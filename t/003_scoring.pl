@@ -0,0 +1,97 @@
+# eviction score under connection pressure
+use strict;
+use warnings;
+
+use IPC::Run;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('scoring');
+$node->init;
+
+# only the idle time and the reconnect rate count in the score
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'pg_timeout'
+max_connections = 100
+pg_timeout.naptime = '100ms'
+pg_timeout.idle_session_timeout = '1h'
+pg_timeout.pressure_min_idle = '1s'
+pg_timeout.score_idle_weight = 1
+pg_timeout.score_memory_weight = 0
+pg_timeout.score_age_weight = 0
+pg_timeout.score_reconnect_weight = 1000
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION pg_timeout');
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_timeout'"
+) or die 'worker not started';
+
+my @sessions;
+my %opened;
+
+# open an idle session, which stays until its backend is terminated
+sub idle_session
+{
+	my ($app) = @_;
+	my $stdin = '';
+	my $output = '';
+
+	push @sessions,
+	  IPC::Run::start(
+		[
+			'psql', '-XAtq', '-d',
+			$node->connstr('postgres') . " application_name=$app"
+		],
+		'<', \$stdin, '>', \$output, '2>', \$output);
+	$opened{$app}++;
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = $opened{$app} FROM pg_stat_activity WHERE application_name = '$app' AND state = 'idle'"
+	) or die "session $app not idle";
+}
+
+# change settings and wait for the worker to apply them
+sub reconfigure
+{
+	my ($sql) = @_;
+	my $generation = $node->safe_psql('postgres',
+		'SELECT generation FROM pg_timeout_policy()');
+
+	$node->safe_psql('postgres', "$sql\nSELECT pg_reload_conf();");
+	$node->poll_query_until('postgres',
+		"SELECT generation > $generation FROM pg_timeout_policy()")
+	  or die 'configuration not applied';
+}
+
+# A pool opening 6 connections reconnects more often than two clients
+# opening one each: its sessions cost more to evict, although they are
+# idle for longer.  Evicting by idle time alone would pick them first.
+idle_session('pool') foreach 1 .. 6;
+idle_session('cold1');
+idle_session('cold2');
+
+# 7% of max_connections: 8 idle sessions and the one checking are 2 too
+# many, or 1 when it is not connected
+reconfigure('ALTER SYSTEM SET pg_timeout.pressure_threshold = 7;');
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE application_name LIKE 'cold%'"
+	),
+	'sessions of the clients reconnecting least evicted');
+is( $node->safe_psql(
+		'postgres',
+		"SELECT count(*) FROM pg_stat_activity WHERE application_name = 'pool'"),
+	'6',
+	'sessions of the pool kept');
+like(
+	slurp_file($node->logfile),
+	qr/application=cold1 hostname=\S+ reason=connection_pressure score=/,
+	'eviction logged with its score');
+
+$_->kill_kill foreach @sessions;
+$node->stop;
+
+done_testing();
@@ -0,0 +1,112 @@
+# idle session quotas per role and per database
+use strict;
+use warnings;
+
+use IPC::Run;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('quotas');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'pg_timeout'
+pg_timeout.naptime = '100ms'
+pg_timeout.idle_session_timeout = '1h'
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_timeout;
+CREATE ROLE alice LOGIN;
+CREATE ROLE bob LOGIN;
+CREATE ROLE carol LOGIN;
+CREATE DATABASE db1;
+CREATE DATABASE db2;
+});
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_timeout'"
+) or die 'worker not started';
+
+my @sessions;
+
+# open an idle session, which stays until its backend is terminated; the
+# sessions opened first are the longest idle
+sub idle_session
+{
+	my ($app, $user, $dbname) = @_;
+	my $stdin = '';
+	my $output = '';
+
+	push @sessions,
+	  IPC::Run::start(
+		[
+			'psql', '-XAtq', '-d',
+			$node->connstr($dbname) . " user=$user application_name=$app"
+		],
+		'<', \$stdin, '>', \$output, '2>', \$output);
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = 1 FROM pg_stat_activity WHERE application_name = '$app' AND state = 'idle'"
+	) or die "session $app not idle";
+}
+
+# change settings and wait for the worker to apply them
+sub reconfigure
+{
+	my ($sql) = @_;
+	my $generation = $node->safe_psql('postgres',
+		'SELECT generation FROM pg_timeout_policy()');
+
+	$node->safe_psql('postgres', "$sql\nSELECT pg_reload_conf();");
+	$node->poll_query_until('postgres',
+		"SELECT generation > $generation FROM pg_timeout_policy()")
+	  or die 'configuration not applied';
+}
+
+# the sessions checking the result are in another database
+sub remaining
+{
+	return $node->safe_psql('postgres',
+		"SELECT string_agg(application_name, ',' ORDER BY application_name) FROM pg_stat_activity WHERE datname IN ('db1', 'db2') AND backend_type = 'client backend'"
+	);
+}
+
+idle_session('a1', 'alice', 'db1');
+idle_session('a2', 'alice', 'db1');
+idle_session('a3', 'alice', 'db1');
+idle_session('b1', 'bob', 'db1');
+idle_session('c1', 'carol', 'db2');
+idle_session('c2', 'carol', 'db2');
+
+reconfigure('ALTER SYSTEM SET pg_timeout.max_idle_per_role = 2;');
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE application_name = 'a1'"
+	),
+	'longest idle session of the role over its quota terminated');
+is(remaining(), 'a2,a3,b1,c1,c2', 'sessions within the role quota kept');
+like(
+	slurp_file($node->logfile),
+	qr/user=alice database=db1 application=a1 hostname=\S+ reason=max_idle_per_role=2/,
+	'role quota termination logged');
+
+reconfigure(
+	'ALTER SYSTEM RESET pg_timeout.max_idle_per_role;
+ALTER SYSTEM SET pg_timeout.max_idle_per_database = 2;');
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE application_name = 'a2'"
+	),
+	'longest idle session of the database over its quota terminated');
+is(remaining(), 'a3,b1,c1,c2', 'sessions within the database quota kept');
+like(
+	slurp_file($node->logfile),
+	qr/user=alice database=db1 application=a2 hostname=\S+ reason=max_idle_per_database=2/,
+	'database quota termination logged');
+
+$_->kill_kill foreach @sessions;
+$node->stop;
+
+done_testing();
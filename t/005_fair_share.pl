@@ -0,0 +1,120 @@
+# fair share selection across tenants under connection pressure
+use strict;
+use warnings;
+
+use IPC::Run;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('fair_share');
+$node->init;
+
+# only the idle time counts in the score
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'pg_timeout'
+max_connections = 100
+pg_timeout.naptime = '100ms'
+pg_timeout.idle_session_timeout = '1h'
+pg_timeout.pressure_selection = fair_share
+pg_timeout.pressure_min_idle = '500ms'
+pg_timeout.score_idle_weight = 1
+pg_timeout.score_memory_weight = 0
+pg_timeout.score_age_weight = 0
+pg_timeout.score_reconnect_weight = 0
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_timeout;
+CREATE ROLE alice LOGIN;
+CREATE ROLE bob LOGIN;
+CREATE DATABASE db1;
+});
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_timeout'"
+) or die 'worker not started';
+
+my @sessions;
+
+# open an idle session, which stays until its backend is terminated; the
+# sessions opened first are the longest idle
+sub idle_session
+{
+	my ($app, $user) = @_;
+	my $stdin = '';
+	my $output = '';
+
+	push @sessions,
+	  IPC::Run::start(
+		[
+			'psql', '-XAtq', '-d',
+			$node->connstr('db1') . " user=$user application_name=$app"
+		],
+		'<', \$stdin, '>', \$output, '2>', \$output);
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = 1 FROM pg_stat_activity WHERE application_name = '$app' AND state = 'idle'"
+	) or die "session $app not idle";
+}
+
+# change settings and wait for the worker to apply them
+sub reconfigure
+{
+	my ($sql) = @_;
+	my $generation = $node->safe_psql('postgres',
+		'SELECT generation FROM pg_timeout_policy()');
+
+	$node->safe_psql('postgres', "$sql\nSELECT pg_reload_conf();");
+	$node->poll_query_until('postgres',
+		"SELECT generation > $generation FROM pg_timeout_policy()")
+	  or die 'configuration not applied';
+}
+
+# sessions left to each user
+sub remaining
+{
+	return $node->safe_psql('postgres',
+		"SELECT string_agg(usename || '=' || n, ',' ORDER BY usename) FROM (SELECT usename, count(*) AS n FROM pg_stat_activity WHERE datname = 'db1' AND backend_type = 'client backend' GROUP BY usename) s"
+	);
+}
+
+# the sessions of alice are the longest idle: the best scores alone would
+# evict them all
+idle_session("a$_", 'alice') foreach 1 .. 4;
+idle_session("b$_", 'bob') foreach 1 .. 4;
+$node->poll_query_until('postgres',
+	"SELECT min(now() - state_change) > interval '500ms' FROM pg_stat_activity WHERE datname = 'db1' AND backend_type = 'client backend'"
+) or die 'sessions not eligible';
+
+# 7% of max_connections: 8 idle sessions and the one checking are 2 too
+# many, or 1 when it is not connected
+reconfigure('ALTER SYSTEM SET pg_timeout.pressure_threshold = 7;');
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 6 FROM pg_stat_activity WHERE datname = 'db1' AND backend_type = 'client backend'"
+	),
+	'sessions evicted down to the threshold');
+is(remaining(), 'alice=3,bob=3', 'evictions spread over the tenants');
+like(
+	slurp_file($node->logfile),
+	qr/user=bob database=db1 application=b\d hostname=\S+ reason=connection_pressure fair_share score=/,
+	'eviction logged with its reason');
+
+# with priority 4, bob loses a quarter as many sessions as alice
+reconfigure(
+	"ALTER SYSTEM SET pg_timeout.tenant_priorities = 'role=bob 4';
+ALTER SYSTEM SET pg_timeout.pressure_threshold = 5;");
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 4 FROM pg_stat_activity WHERE datname = 'db1' AND backend_type = 'client backend'"
+	),
+	'sessions evicted down to the new threshold');
+is(remaining(), 'alice=1,bob=3',
+	'evictions spread by the priorities of the tenants');
+
+$_->kill_kill foreach @sessions;
+$node->stop;
+
+done_testing();
@@ -0,0 +1,105 @@
+# draining the sessions of a database with pg_timeout_drain()
+use strict;
+use warnings;
+
+use IPC::Run;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('drain');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'pg_timeout'
+pg_timeout.naptime = '100ms'
+pg_timeout.idle_session_timeout = '1h'
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_timeout;
+CREATE DATABASE app;
+CREATE DATABASE other;
+});
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_timeout'"
+) or die 'worker not started';
+
+my @sessions;
+
+# open a session, which stays until its backend is terminated, and wait
+# for it to be in the given state
+sub open_session
+{
+	my ($app, $dbname, $state, $sql) = @_;
+	my $session = { stdin => defined $sql ? "$sql\n" : '', output => '' };
+
+	$session->{harness} = IPC::Run::start(
+		[
+			'psql', '-XAtq', '-d',
+			$node->connstr($dbname) . " application_name=$app"
+		],
+		'<', \$session->{stdin},
+		'>', \$session->{output},
+		'2>', \$session->{output});
+	push @sessions, $session;
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = 1 FROM pg_stat_activity WHERE application_name = '$app' AND state = '$state'"
+	) or die "session $app not $state";
+	return $session;
+}
+
+sub remaining
+{
+	return $node->safe_psql('postgres',
+		"SELECT string_agg(application_name, ',' ORDER BY application_name) FROM pg_stat_activity WHERE datname IN ('app', 'other') AND backend_type = 'client backend'"
+	);
+}
+
+open_session('i1', 'app', 'idle');
+open_session('i2', 'app', 'idle');
+my $x1 = open_session('x1', 'app', 'idle in transaction', 'BEGIN;');
+open_session('o1', 'other', 'idle');
+
+my $drain_output = '';
+my $drain = IPC::Run::start(
+	[
+		'psql', '-XAtq', '-d', $node->connstr('postgres'), '-c',
+		"SELECT count(*) FROM pg_timeout_drain('app', now() + interval '3 min')"
+	],
+	'>', \$drain_output, '2>', \$drain_output);
+
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 0 FROM pg_stat_activity WHERE application_name IN ('i1', 'i2')"
+	),
+	'idle sessions drained at once');
+is(remaining(), 'o1,x1', 'session in a transaction kept until its end');
+
+# the session is terminated as soon as its transaction is over
+$x1->{stdin} .= "COMMIT;\n";
+$x1->{harness}->pump_nb while length $x1->{stdin};
+$drain->finish;
+is($drain_output, "0\n", 'drain over once the database has no session');
+is(remaining(), 'o1', 'session drained at the end of its transaction');
+like(
+	slurp_file($node->logfile),
+	qr/database=app application=x1 hostname=\S+ reason=drain/,
+	'drain logged');
+
+# sessions still in a transaction at the deadline are returned
+open_session('x2', 'app', 'idle in transaction', 'BEGIN;');
+is( $node->safe_psql(
+		'postgres',
+		"SELECT application_name, state FROM pg_timeout_drain('app', now() + interval '1 s')"
+	),
+	'x2|idle in transaction',
+	'sessions left at the deadline returned');
+is(remaining(), 'o1,x2', 'session in a transaction kept after the deadline');
+
+$_->{harness}->kill_kill foreach @sessions;
+$node->stop;
+
+done_testing();